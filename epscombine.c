@@ -0,0 +1,429 @@
+/** \file epscombine.c
+ *
+ *  Combines an EPS file printed with the OpenGL or Z-buffer renderer with
+ *  the text of the same figure printed with painters, for matlabfrag,
+ *    Count = epscombine( EpsFile, PaintersFile, OutputFile )
+ *  The text objects and font resources of the painters file are copied,
+ *  in the order they appear, into the EPS file just before the end of its
+ *  colour dictionary ("end %%Color Dict"), and the result written to
+ *  OutputFile. Returns the number of pieces of text copied.
+ *
+ *  This is the same as the Matlab code in matlabfrag's EpsCombine (which
+ *  is used when this hasn't been compiled), but without reading either
+ *  file into a Matlab string. The painters file is read into memory once
+ *  and scanned for the text as it is inserted, while the EPS file is
+ *  streamed through a fixed size buffer. Compile with
+ *    mex epscombine.c
+ *
+ *  See the license at the bottom of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mex.h"
+
+/* Size of the buffer the EPS file is streamed through */
+#define BLOCKSIZE (1<<20)
+/* The text is inserted before this line of the EPS file */
+#define COLORDICT_END "end %%Color Dict"
+
+/* Return values of EpsCombine */
+#define COMBINE_OK 0
+#define COMBINE_CANT_READ 1
+#define COMBINE_CANT_READ_PAINTERS 2
+#define COMBINE_CANT_WRITE 3
+#define COMBINE_OUT_OF_MEMORY 4
+#define COMBINE_READ_ERROR 5
+#define COMBINE_WRITE_ERROR 6
+#define COMBINE_NO_COLORDICT 7
+
+/**
+ *  Whitespace, as matched by \s in a Matlab regular expression.
+ */
+static int is_space( char x )
+{
+  return x == ' ' || x == '\t' || x == '\n' || x == '\r' || x == '\f' || x == '\v';
+}
+
+static int is_digit( char x )
+{
+  return x >= '0' && x <= '9';
+}
+
+/**
+ *  Test whether x[0..n) starts with the lower case string Prefix,
+ *  ignoring case.
+ */
+static int starts_with( const char *x, size_t n, const char *Prefix )
+{
+  size_t ii;
+
+  for( ii=0; Prefix[ii] != '\0'; ii++ )
+    if( ii == n || tolower( (unsigned char)x[ii] ) != Prefix[ii] ) return 0;
+  return 1;
+}
+
+/**
+ *  Match "\s+-?\d+\s+rotate" at x[p]. Returns the end of the match, or 0
+ *  if there isn't one.
+ */
+static size_t match_rotate( const char *x, size_t n, size_t p )
+{
+  size_t k = p, e;
+
+  while( k < n && is_space( x[k] ) ) k++;
+  if( k == p ) return 0;
+  if( k < n && x[k] == '-' ) k++;
+  e = k;
+  while( k < n && is_digit( x[k] ) ) k++;
+  if( k == e ) return 0;
+  e = k;
+  while( k < n && is_space( x[k] ) ) k++;
+  if( k == e || !starts_with( x+k, n-k, "rotate" ) ) return 0;
+  return k+6;
+}
+
+/**
+ *  Scanners for the text of a painters file, each of which finds the next
+ *  match of one of matlabfrag's regular expressions (ignoring case, and
+ *  with . matching newlines too) in x[From..n). They match what Matlab's
+ *  regexpi would, and return 0 once there are no more matches.
+ *
+ *  Text objects,
+ *    -?\d+\s+-?\d+\s+mt(\s+-?\d+\s+rotate)?\s+\(.+?\)\s+s(\s+-?\d+\s+rotate)?
+ *  are found from the "mt" of each one. The match starts as far before it
+ *  as the coordinates go, which is where the leftmost match would.
+ */
+static int find_text_object( const char *x, size_t n, size_t From, size_t *Start, size_t *End )
+{
+  const char *q;
+  size_t p, k, e, r;
+
+  for( p=From; p+1<n; p++ )
+  {
+    if( tolower( (unsigned char)x[p] ) != 'm' || tolower( (unsigned char)x[p+1] ) != 't' )
+      continue;
+
+    /* Back over the "-?\d+\s+-?\d+\s+" before the mt */
+    k = p;
+    while( k > From && is_space( x[k-1] ) ) k--;
+    if( k == p ) continue;
+    e = k;
+    while( k > From && is_digit( x[k-1] ) ) k--;
+    if( k == e ) continue;
+    if( k > From && x[k-1] == '-' ) k--;
+    e = k;
+    while( k > From && is_space( x[k-1] ) ) k--;
+    if( k == e ) continue;
+    e = k;
+    while( k > From && is_digit( x[k-1] ) ) k--;
+    if( k == e ) continue;
+    if( k > From && x[k-1] == '-' ) k--;
+    *Start = k;
+
+    /* Then the optional rotation, and the start of the string */
+    k = p+2;
+    r = match_rotate( x, n, k );
+    if( r ) k = r;
+    e = k;
+    while( k < n && is_space( x[k] ) ) k++;
+    if( k == e || k == n || x[k] != '(' ) continue;
+
+    /* The string runs to the first ')' (after at least one character)
+       followed by whitespace and an s. If there isn't one, no later text
+       object can be matched either. */
+    for( e=k+2; e<n; e=(size_t)( q-x )+1 )
+    {
+      q = (const char *)memchr( x+e, ')', n-e );
+      if( q == NULL ) return 0;
+      r = (size_t)( q-x )+1;
+      while( r < n && is_space( x[r] ) ) r++;
+      if( r > (size_t)( q-x )+1 && r < n && tolower( (unsigned char)x[r] ) == 's' ) break;
+    }
+    if( e >= n ) return 0;
+    r++;
+
+    /* Followed by an optional rotation back */
+    e = match_rotate( x, n, r );
+    *End = e ? e : r;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ *  Font resources,
+ *    %%IncludeResource:\s+font.*?\n.?\n
+ */
+static int find_font_header( const char *x, size_t n, size_t From, size_t *Start, size_t *End )
+{
+  const char *q;
+  size_t p, k, e;
+
+  for( p=From; p<n && ( q = (const char *)memchr( x+p, '%', n-p ) ) != NULL;
+       p=(size_t)( q-x )+1 )
+  {
+    k = (size_t)( q-x );
+    if( !starts_with( x+k, n-k, "%%includeresource:" ) ) continue;
+    k += 18;
+    e = k;
+    while( k < n && is_space( x[k] ) ) k++;
+    if( k == e || !starts_with( x+k, n-k, "font" ) ) continue;
+
+    /* The first newline followed by a newline, with up to one character
+       in between. If there isn't one, no later resource can match. */
+    for( k+=4; k<n; k++ )
+    {
+      if( x[k] != '\n' ) continue;
+      if( k+2 < n && x[k+2] == '\n' ) e = k+3;
+      else if( k+1 < n && x[k+1] == '\n' ) e = k+2;
+      else continue;
+      *Start = (size_t)( q-x );
+      *End = e;
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+/**
+ *  Read a whole file into an allocated buffer. Returns 0 on success.
+ */
+static int read_file( const char *filename, char **x, size_t *n )
+{
+  FILE *fh;
+  char *buffer, *newBuffer;
+  size_t capacity = BLOCKSIZE, length = 0, m;
+
+  fh = fopen( filename, "rb" );
+  if( fh == NULL ) return COMBINE_CANT_READ_PAINTERS;
+  buffer = (char *)malloc( capacity );
+  while( buffer != NULL && ( m = fread( buffer+length, 1, capacity-length, fh ) ) > 0 )
+  {
+    length += m;
+    if( length < capacity ) continue;
+    newBuffer = (char *)realloc( buffer, 2*capacity );
+    if( newBuffer == NULL ) free( buffer );
+    buffer = newBuffer;
+    capacity *= 2;
+  }
+  if( buffer == NULL )
+  {
+    fclose( fh );
+    return COMBINE_OUT_OF_MEMORY;
+  }
+  if( ferror( fh ) )
+  {
+    fclose( fh );
+    free( buffer );
+    return COMBINE_READ_ERROR;
+  }
+  fclose( fh );
+  *x = buffer;
+  *n = length;
+  return COMBINE_OK;
+}
+
+/**
+ *  Write out the text of the painters file x[0..n), each piece of text
+ *  followed by a newline. Where the text objects and font resources are
+ *  interleaved, they are taken in the order they start in the file.
+ */
+static size_t write_text( const char *x, size_t n, FILE *fout )
+{
+  size_t objStart = 0, objEnd = 0, hdrStart = 0, hdrEnd = 0, count = 0;
+  int haveObj, haveHdr;
+
+  haveObj = find_text_object( x, n, 0, &objStart, &objEnd );
+  haveHdr = find_font_header( x, n, 0, &hdrStart, &hdrEnd );
+  while( haveObj || haveHdr )
+  {
+    if( haveHdr && ( !haveObj || hdrStart <= objStart ) )
+    {
+      fwrite( x+hdrStart, 1, hdrEnd-hdrStart, fout );
+      haveHdr = find_font_header( x, n, hdrEnd, &hdrStart, &hdrEnd );
+    }
+    else
+    {
+      fwrite( x+objStart, 1, objEnd-objStart, fout );
+      haveObj = find_text_object( x, n, objEnd, &objStart, &objEnd );
+    }
+    fputc( '\n', fout );
+    count++;
+  }
+  /* Matlab's sprintf gives a lone newline when there isn't any text */
+  if( count == 0 ) fputc( '\n', fout );
+  return count;
+}
+
+/**
+ *  Find the first occurrence of the COLORDICT_END marker in x[0..n), or
+ *  return NULL.
+ */
+static const char *find_colordict_end( const char *x, size_t n )
+{
+  const size_t length = sizeof( COLORDICT_END )-1;
+  const char *p = x, *end = x+n;
+
+  while( (size_t)( end-p ) >= length &&
+         ( p = (const char *)memchr( p, 'e', (size_t)( end-p ) - length + 1 ) ) != NULL )
+  {
+    if( memcmp( p, COLORDICT_END, length ) == 0 ) return p;
+    p++;
+  }
+  return NULL;
+}
+
+/**
+ *  Combine EpsFile with the text of PaintersFile into OutFile, returning
+ *  the number of pieces of text in Count. The output is laid out as
+ *  matlabfrag always has: the EPS file up to the marker, a blank line,
+ *  the text, a newline, then the rest of the EPS file.
+ */
+static int EpsCombine( const char *EpsFile, const char *PaintersFile, const char *OutFile,
+  size_t *Count )
+{
+  FILE *fin, *fout;
+  char *painters, *buffer;
+  const char *marker;
+  size_t paintersLength, length = 0, keep, n;
+  int status, found = 0;
+
+  *Count = 0;
+  status = read_file( PaintersFile, &painters, &paintersLength );
+  if( status != COMBINE_OK ) return status;
+  buffer = (char *)malloc( BLOCKSIZE );
+  if( buffer == NULL )
+  {
+    free( painters );
+    return COMBINE_OUT_OF_MEMORY;
+  }
+  fin = fopen( EpsFile, "rb" );
+  if( fin == NULL )
+  {
+    free( painters );
+    free( buffer );
+    return COMBINE_CANT_READ;
+  }
+  fout = fopen( OutFile, "wb" );
+  if( fout == NULL )
+  {
+    fclose( fin );
+    free( painters );
+    free( buffer );
+    return COMBINE_CANT_WRITE;
+  }
+
+  /* Copy the EPS file through the buffer, holding back enough of the end
+     of each block to find the marker across blocks. */
+  keep = sizeof( COLORDICT_END )-2;
+  while( ( n = fread( buffer+length, 1, BLOCKSIZE-length, fin ) ) > 0 )
+  {
+    length += n;
+    if( !found && ( marker = find_colordict_end( buffer, length ) ) != NULL )
+    {
+      fwrite( buffer, 1, (size_t)( marker-buffer ), fout );
+      fputs( "\n\n", fout );
+      *Count = write_text( painters, paintersLength, fout );
+      fputc( '\n', fout );
+      length -= (size_t)( marker-buffer );
+      memmove( buffer, marker, length );
+      found = 1;
+    }
+    if( found )
+    {
+      fwrite( buffer, 1, length, fout );
+      length = 0;
+    }
+    else if( length > keep )
+    {
+      fwrite( buffer, 1, length-keep, fout );
+      memmove( buffer, buffer+length-keep, keep );
+      length = keep;
+    }
+  }
+  if( ferror( fin ) ) status = COMBINE_READ_ERROR;
+  else if( !found ) status = COMBINE_NO_COLORDICT;
+  fclose( fin );
+  if( ferror( fout ) && status == COMBINE_OK ) status = COMBINE_WRITE_ERROR;
+  if( fclose( fout ) != 0 && status == COMBINE_OK ) status = COMBINE_WRITE_ERROR;
+  if( status != COMBINE_OK ) remove( OutFile );
+  free( painters );
+  free( buffer );
+  return status;
+}
+
+/**
+ *  Error message for a non-zero return value of EpsCombine.
+ */
+static const char *CombineErrorMessage( int status )
+{
+  switch( status )
+  {
+    case COMBINE_CANT_READ: return "Cannot open the EPS file for reading.";
+    case COMBINE_CANT_READ_PAINTERS: return "Cannot open the painters file for reading.";
+    case COMBINE_CANT_WRITE: return "Cannot open the output file for writing.";
+    case COMBINE_OUT_OF_MEMORY: return "Out of memory.";
+    case COMBINE_READ_ERROR: return "Error reading the input files.";
+    case COMBINE_WRITE_ERROR: return "Error writing to the output file.";
+    case COMBINE_NO_COLORDICT: return "The EPS file has no colour dictionary to insert the text into.";
+  }
+  return "";
+}
+
+/**
+ *  Main function call in a c-mex environment,
+ *    Count = epscombine( EpsFile, PaintersFile, OutputFile )
+ *  The output file must not be one of the input files.
+ */
+void mexFunction(int nlhs,mxArray *plhs[],int nrhs,const mxArray *prhs[])
+{
+  char *files[3];
+  size_t count;
+  int ii, status;
+
+  if( nrhs != 3 ) mexErrMsgTxt("Three input arguments required.\n");
+  if( nlhs > 1 ) mexErrMsgTxt("Too many output arguments.\n");
+  for( ii=0; ii<3; ii++ )
+  {
+    if( !mxIsChar( prhs[ii] ) ) mexErrMsgTxt("Inputs (filenames) must be of type string.\n");
+    files[ii] = mxArrayToString( prhs[ii] );
+  }
+  if( strcmp( files[2], files[0] ) == 0 || strcmp( files[2], files[1] ) == 0 )
+    mexErrMsgTxt("The output file must not be one of the input files.\n");
+
+  status = EpsCombine( files[0], files[1], files[2], &count );
+  for( ii=0; ii<3; ii++ ) mxFree( files[ii] );
+  if( status != COMBINE_OK ) mexErrMsgIdAndTxt("epscombine:failed","%s",CombineErrorMessage( status ));
+  if( nlhs == 1 ) plhs[0] = mxCreateDoubleScalar( (double)count );
+}
+
+/*
+ Copyright (c) 2010, Zebb Prime
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+     * Neither the name of the organisation nor the
+       names of its contributors may be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL ZEBB PRIME BE LIABLE FOR ANY
+ DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
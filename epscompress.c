@@ -3,11 +3,9 @@
  *  Compresses an EPS file generated from Matlab using the LZW
  *  algorithm.
  *
- *  According to most sources, the patents for LZW compression expired
- *  around 2003--2004.  If this is incorrect, please let the author know.
- *  
- *  This particular algorithm uses an unbalenced binary search tree to
- *  determine if a string exists in the dictionary.
+ *  This is the MEX interface; the compressor itself is in
+ *  epscompress_core.c. Compile with
+ *    mex epscompress.c epscompress_core.c
  *
  *  Version 0.2 10-Sep-2010
  *
@@ -17,387 +15,759 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #include "mex.h"
+#include "epscompress_core.h"
 
-/* Maximum table size, 2^MaxBits */
-#define TABLESIZE 4096
-/* Number of branches for each node */
-#define TABLEDEPTH 3
-/* Locations of each tree branch */
-#define CHILD 0
-#define LEFT 1
-#define RIGHT 2
-/* Max/Min output bit sizes. */
-#define BITMAX 12
-#define BITMIN 9
-/* Special input/output values. */
-#define CLEARTABLE 256
-#define ENDOFDATA 257
-/* First free location in the index. */
-#define FIRSTFREE 258
-/* Maximum string storage space */
-#define MAXSTR 1024
-/* Maximum output width. */
-#define OUTPUTWIDTH 75
-/* Number of lines between DSC comments before compression starts */
-#define DSCGRACE 10
+/* Status of a queued job that hasn't finished yet */
+#define JOB_PENDING -1
 
 /**
- *  Structure containing information about the current LZW
- *  compression state.
+ *  Case insensitive string comparison, returning non-zero if equal.
  */
-typedef struct{
-  /* Index and dictionary tables */
-  unsigned int Index[ TABLEDEPTH ][ TABLESIZE ];
-  unsigned char Dictionary[ TABLESIZE ];
-  /* Current character being processed. */
-  unsigned char CurrentChar;
-  /* Current index (equivalent to the prefix). */
-  int CurrentIndex;
-  /* Next free index. */
-  unsigned int NextIndex;
-  /* Variable to store the maximum index for the current bitsize */
-  unsigned int MaxIndex;
-  /* Current output bitsize. */
-  unsigned int BitSize;  
-} LZW_State;
+static int str_iequal( const char *x, const char *y )
+{
+  while( *x && tolower( (unsigned char)*x ) == tolower( (unsigned char)*y ) )
+  {
+    x++;
+    y++;
+  }
+  return *x == *y;
+}
 
 /**
- *  Structure containing information about the IO state.
+ *  Parse the trailing 'Name',Value option pairs. Async is set by the
+ *  'async' option, which is only allowed where Async isn't NULL.
  */
-typedef struct{
-  /* File pointers */
-  FILE *fin;
-  FILE *fout;
-  unsigned int Storage;
-  unsigned int ColumnWidth;
-  int StorageIndex;
-} IO_State;
+static void ParseOptions( int nrhs, const mxArray *prhs[], EPS_Options *o, int *Async )
+{
+  char *name;
+  double value, *pad;
+  int ii, jj;
+  
+  for( ii=0; ii<nrhs; ii+=2 )
+  {
+    if( !mxIsChar( prhs[ii] ) ) mexErrMsgTxt("Option names must be strings.\n");
+    if( ii+1 == nrhs ) mexErrMsgTxt("Options must be given as name, value pairs.\n");
+    name = mxArrayToString( prhs[ii] );
+    if( str_iequal( name, "threads" ) )
+    {
+      if( !mxIsNumeric( prhs[ii+1] ) || mxGetNumberOfElements( prhs[ii+1] ) != 1 )
+        mexErrMsgTxt("The threads option must be a scalar.\n");
+      value = mxGetScalar( prhs[ii+1] );
+      if( value < 0 ) mexErrMsgTxt("The threads option must not be negative.\n");
+      o->Threads = value > MAXTHREADS ? MAXTHREADS : (int)value;
+    }
+    else if( str_iequal( name, "ascii85" ) )
+    {
+      if( !( mxIsNumeric( prhs[ii+1] ) || mxIsLogical( prhs[ii+1] ) ) ||
+          mxGetNumberOfElements( prhs[ii+1] ) != 1 )
+        mexErrMsgTxt("The ascii85 option must be a logical scalar.\n");
+      o->Ascii85 = mxGetScalar( prhs[ii+1] ) != 0;
+    }
+    else if( str_iequal( name, "images" ) )
+    {
+      if( !( mxIsNumeric( prhs[ii+1] ) || mxIsLogical( prhs[ii+1] ) ) ||
+          mxGetNumberOfElements( prhs[ii+1] ) != 1 )
+        mexErrMsgTxt("The images option must be a logical scalar.\n");
+      o->Images = mxGetScalar( prhs[ii+1] ) != 0;
+    }
+    else if( str_iequal( name, "downsample" ) )
+    {
+      if( !mxIsNumeric( prhs[ii+1] ) || mxGetNumberOfElements( prhs[ii+1] ) != 1 )
+        mexErrMsgTxt("The downsample option must be a scalar.\n");
+      value = mxGetScalar( prhs[ii+1] );
+      if( !( value >= 1 && value <= MAXDOWNSAMPLE ) || value != (int)value )
+        mexErrMsgTxt("The downsample option must be an integer from 1 to 64.\n");
+      o->Downsample = (int)value;
+    }
+    else if( str_iequal( name, "reset" ) )
+    {
+      if( !mxIsChar( prhs[ii+1] ) ) mexErrMsgTxt("The reset option must be a string.\n");
+      mxFree( name );
+      name = mxArrayToString( prhs[ii+1] );
+      if( str_iequal( name, "full" ) ) o->AdaptiveReset = 0;
+      else if( str_iequal( name, "adaptive" ) ) o->AdaptiveReset = 1;
+      else mexErrMsgIdAndTxt("epscompress:option","Unknown reset policy '%s'.\n",name);
+    }
+    else if( str_iequal( name, "method" ) )
+    {
+      if( !mxIsChar( prhs[ii+1] ) ) mexErrMsgTxt("The method option must be a string.\n");
+      mxFree( name );
+      name = mxArrayToString( prhs[ii+1] );
+      if( str_iequal( name, "lzw" ) ) o->Method = EPS_LZW;
+      else if( str_iequal( name, "flate" ) ) o->Method = EPS_FLATE;
+      else mexErrMsgIdAndTxt("epscompress:option","Unknown method '%s'.\n",name);
+    }
+    else if( str_iequal( name, "epspad" ) )
+    {
+      if( !mxIsDouble( prhs[ii+1] ) || mxIsComplex( prhs[ii+1] ) ||
+          mxGetNumberOfElements( prhs[ii+1] ) != 4 )
+        mexErrMsgTxt("The epspad option must be a 4 element vector.\n");
+      pad = mxGetPr( prhs[ii+1] );
+      for( jj=0; jj<4; jj++ )
+      {
+        if( !( pad[jj] > -1e6 && pad[jj] < 1e6 ) )
+          mexErrMsgTxt("The epspad option must be finite.\n");
+        o->Pad[jj] = (int)( pad[jj] < 0 ? pad[jj] - 0.5 : pad[jj] + 0.5 );
+      }
+    }
+    else if( str_iequal( name, "async" ) && Async != NULL )
+    {
+      if( !( mxIsNumeric( prhs[ii+1] ) || mxIsLogical( prhs[ii+1] ) ) ||
+          mxGetNumberOfElements( prhs[ii+1] ) != 1 )
+        mexErrMsgTxt("The async option must be a logical scalar.\n");
+      *Async = mxGetScalar( prhs[ii+1] ) != 0;
+    }
+    else mexErrMsgIdAndTxt("epscompress:option","Unknown option '%s'.\n",name);
+    mxFree( name );
+  }
+}
 
 /**
- *  Initialise LZW_State data structure.
+ *  Convert the statistics of a compression to a struct.
  */
-void LZW_State_Init( LZW_State *x )
+static mxArray *StatsStruct( const EPS_Stats *s )
 {
-  memset( x->Index, 0, sizeof( x->Index ) );
-  memset( x->Dictionary, 0, sizeof( x->Dictionary ) );
-  x->CurrentChar = 0;
-  x->CurrentIndex = -1;
-  x->NextIndex = FIRSTFREE;
-  x->MaxIndex = (1<<BITMIN);
-  x->BitSize = BITMIN;
+  const char *fields[] = { "BytesIn", "BytesOut", "Segments", "Images", "Resets",
+    "SearchDepth", "CompressTime", "Ascii85Time", "IoTime", "TotalTime", "Hash" };
+  mxArray *x;
+  char hash[ 17 ];
+  
+  x = mxCreateStructMatrix( 1, 1, sizeof( fields )/sizeof( fields[0] ), fields );
+  mxSetField( x, 0, "BytesIn", mxCreateDoubleScalar( (double)s->BytesIn ) );
+  mxSetField( x, 0, "BytesOut", mxCreateDoubleScalar( (double)s->BytesOut ) );
+  mxSetField( x, 0, "Segments", mxCreateDoubleScalar( (double)s->Segments ) );
+  mxSetField( x, 0, "Images", mxCreateDoubleScalar( (double)s->Images ) );
+  mxSetField( x, 0, "Resets", mxCreateDoubleScalar( (double)s->Resets ) );
+  mxSetField( x, 0, "SearchDepth", mxCreateDoubleScalar( s->Lookups ?
+    1.0 + (double)s->Probes/(double)s->Lookups : 0.0 ) );
+  mxSetField( x, 0, "CompressTime", mxCreateDoubleScalar( s->CompressSeconds ) );
+  mxSetField( x, 0, "Ascii85Time", mxCreateDoubleScalar( s->Ascii85Seconds ) );
+  mxSetField( x, 0, "IoTime", mxCreateDoubleScalar( s->IoSeconds ) );
+  mxSetField( x, 0, "TotalTime", mxCreateDoubleScalar( s->TotalSeconds ) );
+  sprintf( hash, "%016llx", s->Hash );
+  mxSetField( x, 0, "Hash", mxCreateString( hash ) );
+  return x;
 }
 
 /**
- *  Initialise IO_State data structure. File pointers
- *  (fin and fout) need to be initialised seperately.
+ *  A file compression job run in the background.
  */
-void IO_State_Init( IO_State *x )
-{
-  x->Storage = 0;
-  x->ColumnWidth = 0;
-  x->StorageIndex = 0;
-}
+typedef struct{
+  /* File names, malloc'd */
+  char *InFile;
+  char *OutFile;
+  EPS_Options Options;
+  /* Return value of EpsCompressFile, or JOB_PENDING until it has run */
+  int Status;
+  size_t Bytes;
+  /* Whether the job's error has been reported yet */
+  int Reported;
+} Async_Job;
 
 /**
- *  Private function to format the output into at max character widths.
+ *  The queue of background jobs, run in order by one worker thread that
+ *  is started with the first job. Finished jobs are kept, so that their
+ *  status can still be asked for, until the MEX file is cleared. The
+ *  Status and Bytes of the jobs and NextJob are guarded by the lock, as
+ *  is Jobs while the worker is using it; Changed is signalled both when a
+ *  job is queued and when one finishes.
  */
-void asciiprv_put( char x, IO_State *y )
+static struct{
+  Async_Job *Jobs;
+  size_t NumJobs;
+  size_t Capacity;
+  size_t NextJob;
+  int Initialised;
+  int Started;
+  int Stopping;
+#ifdef _WIN32
+  CRITICAL_SECTION Lock;
+  CONDITION_VARIABLE Changed;
+  HANDLE Thread;
+#else
+  pthread_mutex_t Lock;
+  pthread_cond_t Changed;
+  pthread_t Thread;
+#endif
+} Queue;
+
+#ifdef _WIN32
+#define queue_lock() EnterCriticalSection( &Queue.Lock )
+#define queue_unlock() LeaveCriticalSection( &Queue.Lock )
+#define queue_sleep() SleepConditionVariableCS( &Queue.Changed, &Queue.Lock, INFINITE )
+#define queue_signal() WakeAllConditionVariable( &Queue.Changed )
+#else
+#define queue_lock() pthread_mutex_lock( &Queue.Lock )
+#define queue_unlock() pthread_mutex_unlock( &Queue.Lock )
+#define queue_sleep() pthread_cond_wait( &Queue.Changed, &Queue.Lock )
+#define queue_signal() pthread_cond_broadcast( &Queue.Changed )
+#endif
+
+/**
+ *  Run the queued jobs until there are none left and the queue is being
+ *  stopped. This mustn't call the MEX API, as it runs on the worker
+ *  thread.
+ */
+static void queue_work( void )
 {
-  fputc( x, y->fout );
-  y->ColumnWidth++;
-  /* If output is full, print a newline */
-  if( y->ColumnWidth == OUTPUTWIDTH )
+  EPS_Workspace *w;
+  EPS_Options o;
+  const char *in, *out;
+  size_t ii, bytes;
+  int status;
+  
+  w = EPS_Workspace_Create();
+  queue_lock();
+  for(;;)
   {
-    fputc( 10, y->fout );
-    y->ColumnWidth = 0;
+    while( Queue.NextJob == Queue.NumJobs && !Queue.Stopping ) queue_sleep();
+    if( Queue.NextJob == Queue.NumJobs ) break;
+    ii = Queue.NextJob++;
+    in = Queue.Jobs[ii].InFile;
+    out = Queue.Jobs[ii].OutFile;
+    o = Queue.Jobs[ii].Options;
+    queue_unlock();
+    
+    bytes = 0;
+    status = EpsCompressFile( in, out, w, &o, &bytes, NULL );
+    
+    queue_lock();
+    Queue.Jobs[ii].Status = status;
+    Queue.Jobs[ii].Bytes = bytes;
+    queue_signal();
   }
+  queue_unlock();
+  EPS_Workspace_Destroy( w );
+}
+
+#ifdef _WIN32
+static DWORD WINAPI queue_thread( LPVOID x )
+{
+  (void)x;
+  queue_work();
+  return 0;
 }
+#else
+static void *queue_thread( void *x )
+{
+  (void)x;
+  queue_work();
+  return NULL;
+}
+#endif
 
 /**
- *  Takes a variable bit-length raw input stream, and formats it into
- *  ASCII85 format.
+ *  Finish the queued jobs and stop the worker, when the MEX file is
+ *  cleared or Matlab exits.
  */
-void asciistreamout( unsigned int x, IO_State *y, LZW_State *z )
+static void queue_stop( void )
 {
-  int shift, ii;
-  const int divisors[] = { 85*85*85*85, 85*85*85, 85*85, 85, 1 };
-  
-  /* Shift the new data in. */
-  shift = (32-z->BitSize-y->StorageIndex);
-  if( shift >= 0 ) y->Storage |= (x<<shift);
-  else y->Storage |= (x>>-shift);
+  size_t ii;
   
-  y->StorageIndex += z->BitSize;
-  
-  /* If the buffer is full (i.e. 32-bits) output the 5 characters. */
-  if( y->StorageIndex >= 32 )
+  if( Queue.Started )
   {
-    /* Special case, 0 gets written out as z */
-    if( y->Storage == 0 ) asciiprv_put( 'z', y );
-    else
-    {
-      /* Otherwise, output the 5 characters. */
-      for( ii=0; ii<5; ii++ )
-      {
-        asciiprv_put( (char)( ( y->Storage/divisors[ii] )%85+33 ), y );
-      }
-    }
-    y->StorageIndex -= 32;
-    /* Add any left-over bits to the storage. */
-    if( y->StorageIndex == 0 ) y->Storage = 0;
-    else y->Storage = (x<<(32-y->StorageIndex));
+    queue_lock();
+    Queue.Stopping = 1;
+    queue_signal();
+    queue_unlock();
+#ifdef _WIN32
+    WaitForSingleObject( Queue.Thread, INFINITE );
+    CloseHandle( Queue.Thread );
+#else
+    pthread_join( Queue.Thread, NULL );
+#endif
+  }
+  if( Queue.Initialised )
+  {
+#ifdef _WIN32
+    DeleteCriticalSection( &Queue.Lock );
+#else
+    pthread_cond_destroy( &Queue.Changed );
+    pthread_mutex_destroy( &Queue.Lock );
+#endif
+  }
+  for( ii=0; ii<Queue.NumJobs; ii++ )
+  {
+    free( Queue.Jobs[ii].InFile );
+    free( Queue.Jobs[ii].OutFile );
   }
+  free( Queue.Jobs );
+  memset( &Queue, 0, sizeof( Queue ) );
 }
 
 /**
- *  Cleanup the output stream. Outputs whatever partially completed bits
- *  are present.
+ *  Copy a Matlab string to a malloc'd string, or NULL if out of memory.
  */
-void asciistreamout_cleanup( IO_State *y )
+static char *malloc_string( const mxArray *x )
 {
-  int ii,numBytes;
-  const int divisors[] = { 85*85*85*85, 85*85*85, 85*85, 85, 1 };
-
-  /* Only output as many bytes as required, as per Adobe ASCII85 */
-  numBytes = 5 - (32-y->StorageIndex)/8;
-  for( ii=0; ii<numBytes; ii++ )
-  {
-    asciiprv_put( (char)( ( y->Storage/divisors[ii] )%85+33 ), y );
-  }
-    
-  /* Cleanup variables, output the 'end of data' string. */
-  y->StorageIndex = 0;
-  y->Storage = 0;
-  y->ColumnWidth = 0;
-  fprintf(y->fout,"~>");
+  char *mstr, *str;
+  
+  mstr = mxArrayToString( x );
+  str = (char *)malloc( strlen( mstr )+1 );
+  if( str != NULL ) strcpy( str, mstr );
+  mxFree( mstr );
+  return str;
 }
 
 /**
- *  Update the Dictionary with new values, and outputs the current prefix.
+ *  Queue the compression of InFile into OutFile, returning the job's
+ *  number (from 1). The worker thread is started with the first job; if
+ *  it can't be, the job is run straight away instead.
  */
-void NotInDictionary( unsigned int fromNode, unsigned int from, IO_State *y, LZW_State *z )
+static double queue_add( const mxArray *InFile, const mxArray *OutFile, const EPS_Options *o )
 {
-  int temp;
+  Async_Job job, *jobs;
+  size_t capacity;
   
-  /* Update the tables */
-  z->Index[ fromNode ][ from ] = z->NextIndex;
-  z->Dictionary[ z->NextIndex ] = z->CurrentChar;
-  z->NextIndex++;
-
-  /* Output the current index (prefix) */
-  asciistreamout( z->CurrentIndex, y, z );
-  /* Update to the new index (prefix) */
-  z->CurrentIndex = z->CurrentChar;
+  job.InFile = malloc_string( InFile );
+  job.OutFile = malloc_string( OutFile );
+  job.Options = *o;
+  job.Status = JOB_PENDING;
+  job.Bytes = 0;
+  job.Reported = 0;
+  if( job.InFile == NULL || job.OutFile == NULL )
+  {
+    free( job.InFile );
+    free( job.OutFile );
+    mexErrMsgTxt("Out of memory.\n");
+  }
   
-  /* Check to see if bitsize has been exceeded. */
-  if( z->NextIndex == z->MaxIndex )
+  if( !Queue.Initialised )
   {
-    if( z->BitSize == BITMAX )
+#ifdef _WIN32
+    InitializeCriticalSection( &Queue.Lock );
+    InitializeConditionVariable( &Queue.Changed );
+#else
+    pthread_mutex_init( &Queue.Lock, NULL );
+    pthread_cond_init( &Queue.Changed, NULL );
+#endif
+    Queue.Initialised = 1;
+    mexAtExit( queue_stop );
+  }
+  
+  queue_lock();
+  if( Queue.NumJobs == Queue.Capacity )
+  {
+    capacity = Queue.Capacity ? 2*Queue.Capacity : 16;
+    jobs = (Async_Job *)realloc( Queue.Jobs, capacity*sizeof( Async_Job ) );
+    if( jobs == NULL )
     {
-      asciistreamout( CLEARTABLE, y, z );
-      temp = z->CurrentIndex;
-      LZW_State_Init( z );
-      z->CurrentIndex = temp;
+      queue_unlock();
+      free( job.InFile );
+      free( job.OutFile );
+      mexErrMsgTxt("Out of memory.\n");
     }
-    else
+    Queue.Jobs = jobs;
+    Queue.Capacity = capacity;
+  }
+  Queue.Jobs[ Queue.NumJobs++ ] = job;
+  queue_signal();
+  queue_unlock();
+  
+  if( !Queue.Started )
+  {
+#ifdef _WIN32
+    Queue.Thread = CreateThread( NULL, 0, queue_thread, NULL, 0, NULL );
+    Queue.Started = Queue.Thread != NULL;
+#else
+    Queue.Started = pthread_create( &Queue.Thread, NULL, queue_thread, NULL ) == 0;
+#endif
+    if( !Queue.Started )
     {
-      z->BitSize++;
-      z->MaxIndex = (1<<z->BitSize);
+      Queue.Stopping = 1;
+      queue_work();
+      Queue.Stopping = 0;
     }
   }
+  return (double)Queue.NumJobs;
 }
 
 /**
- *  LZW Compression function.
+ *  Look up the job numbers in x, into an mxCalloc'd array of indices.
  */
-void LZW( char x, IO_State *y, LZW_State *z)
+static size_t *JobIndices( const mxArray *x, size_t *n )
 {
-  unsigned int X;
+  size_t *jobs, ii;
+  double *pr;
+  
+  if( !mxIsDouble( x ) || mxIsComplex( x ) )
+    mexErrMsgTxt("Jobs must be given as an array of job numbers.\n");
+  *n = mxGetNumberOfElements( x );
+  pr = mxGetPr( x );
+  jobs = (size_t *)mxCalloc( *n+1, sizeof( size_t ) );
+  for( ii=0; ii<*n; ii++ )
+  {
+    if( !( pr[ii] >= 1 && pr[ii] <= (double)Queue.NumJobs && pr[ii] == (double)(size_t)pr[ii] ) )
+      mexErrMsgIdAndTxt("epscompress:job","Unknown job %g.\n",pr[ii]);
+    jobs[ii] = (size_t)pr[ii] - 1;
+  }
+  return jobs;
+}
 
-  if( z->CurrentIndex == -1 )
+/**
+ *  Whether x is one of the queue commands, '-wait' or '-status'.
+ */
+static int IsQueueCommand( const mxArray *x )
+{
+  char *command;
+  int found;
+  
+  if( !mxIsChar( x ) || mxGetNumberOfElements( x ) > 7 ) return 0;
+  command = mxArrayToString( x );
+  found = str_iequal( command, "-wait" ) || str_iequal( command, "-status" );
+  mxFree( command );
+  return found;
+}
+
+/**
+ *  The queue commands,
+ *    epscompress( '-wait' )
+ *    epscompress( '-wait', FileName )
+ *    [Bytes,Messages] = epscompress( '-wait', Jobs )
+ *    [Bytes,Messages] = epscompress( '-status', Jobs )
+ *    Pending = epscompress( '-status' )
+ *  See mexFunction.
+ */
+static void QueueCommand( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[] )
+{
+  char *command, *filename = NULL;
+  size_t *jobs = NULL, n = 0, ii, pending;
+  int wait, *statuses, all;
+  double *pr;
+  
+  command = mxArrayToString( prhs[0] );
+  wait = str_iequal( command, "-wait" );
+  mxFree( command );
+  if( nrhs > 2 ) mexErrMsgTxt("Too many input arguments.\n");
+  if( nlhs > 2 ) mexErrMsgTxt("Too many output arguments.\n");
+  
+  if( nrhs == 1 && !wait )
   {
-    z->CurrentIndex = x;
+    /* Number of jobs still to finish */
+    pending = 0;
+    if( Queue.Initialised )
+    {
+      queue_lock();
+      for( ii=0; ii<Queue.NumJobs; ii++ ) pending += Queue.Jobs[ii].Status == JOB_PENDING;
+      queue_unlock();
+    }
+    plhs[0] = mxCreateDoubleScalar( (double)pending );
     return;
   }
   
-  z->CurrentChar = x;
-    
-  /* Test to see if prefix exists as a child. */
-  X = z->Index[ CHILD ][ z->CurrentIndex ];
-  if( X==0 )
+  /* The jobs asked about: those given, or for a wait, the ones on a file
+     or all of them */
+  all = nrhs == 1 || mxIsChar( prhs[1] );
+  if( all )
   {
-    NotInDictionary( CHILD, z->CurrentIndex, y, z );
+    if( nlhs > 0 ) mexErrMsgTxt("Only a list of jobs returns their status.\n");
+    if( nrhs == 2 ) filename = mxArrayToString( prhs[1] );
+    n = Queue.NumJobs;
+    jobs = (size_t *)mxCalloc( n+1, sizeof( size_t ) );
+    for( ii=0; ii<n; ii++ ) jobs[ii] = ii;
+  }
+  else jobs = JobIndices( prhs[1], &n );
+  if( n == 0 && !all )
+  {
+    plhs[0] = mxCreateDoubleMatrix( mxGetM( prhs[1] ), mxGetN( prhs[1] ), mxREAL );
+    if( nlhs == 2 ) plhs[1] = mxCreateCellMatrix( mxGetM( prhs[1] ), mxGetN( prhs[1] ) );
     return;
   }
-    
-  /* Binary tree search for current string. */
-  while( 1 )
+  
+  /* Take a copy of the statuses under the lock (waiting for them first),
+     so that no MEX calls, which may not return, are made while holding it */
+  statuses = (int *)mxCalloc( n+1, sizeof( int ) );
+  if( Queue.Initialised )
   {
-    /* If we find a value in the dictionary */
-    if( z->CurrentChar == z->Dictionary[ X ] )
-    {
-      z->CurrentIndex = X;
-      break;
-    }
-    /* Otherwise, search through the tree */
-    if( z->CurrentChar > z->Dictionary[ X ] )
+    queue_lock();
+    for( ii=0; ii<n; ii++ )
     {
-      if( z->Index[ RIGHT ][ X ] == 0 )
-      {
-        NotInDictionary( RIGHT, X, y, z );
-        break;
-      }
+      if( filename != NULL && strcmp( Queue.Jobs[ jobs[ii] ].InFile, filename ) != 0 &&
+          strcmp( Queue.Jobs[ jobs[ii] ].OutFile, filename ) != 0 )
+        statuses[ii] = EPS_OK;
       else
       {
-        X = z->Index[ RIGHT ][ X ];
+        while( wait && Queue.Jobs[ jobs[ii] ].Status == JOB_PENDING ) queue_sleep();
+        statuses[ii] = Queue.Jobs[ jobs[ii] ].Status;
       }
     }
-    else
+    queue_unlock();
+  }
+  
+  /* Unfinished jobs have their byte count set to NaN, failed ones -1 */
+  if( !all )
+  {
+    plhs[0] = mxCreateDoubleMatrix( mxGetM( prhs[1] ), mxGetN( prhs[1] ), mxREAL );
+    pr = mxGetPr( plhs[0] );
+    for( ii=0; ii<n; ii++ )
+      pr[ii] = statuses[ii] == JOB_PENDING ? mxGetNaN() :
+        statuses[ii] == EPS_OK ? (double)Queue.Jobs[ jobs[ii] ].Bytes : -1;
+    if( nlhs == 2 )
+      plhs[1] = mxCreateCellMatrix( mxGetM( prhs[1] ), mxGetN( prhs[1] ) );
+  }
+  
+  /* Report the errors, as messages if asked for, otherwise as warnings
+     the first time they're waited for */
+  for( ii=0; ii<n; ii++ )
+  {
+    if( nlhs == 2 )
     {
-      if( z->Index[ LEFT ][ X ] == 0 )
-      {
-        NotInDictionary( LEFT, X, y, z );
-        break;
-      }
-      else X = z->Index[ LEFT ][ X ];
+      mxSetCell( plhs[1], ii, mxCreateString( statuses[ii] == JOB_PENDING ? "" :
+        EpsErrorMessage( statuses[ii] ) ) );
+      if( statuses[ii] != JOB_PENDING ) Queue.Jobs[ jobs[ii] ].Reported = 1;
+    }
+    else if( wait && statuses[ii] != EPS_OK && !Queue.Jobs[ jobs[ii] ].Reported )
+    {
+      Queue.Jobs[ jobs[ii] ].Reported = 1;
+      mexWarnMsgIdAndTxt("epscompress:async","%s: %s",Queue.Jobs[ jobs[ii] ].InFile,
+        EpsErrorMessage( statuses[ii] ));
     }
   }
+  if( filename != NULL ) mxFree( filename );
+  mxFree( statuses );
+  mxFree( jobs );
 }
 
 /**
- *  Main function call in a c-mex environment.
+ *  Main function call in a c-mex environment. Either compresses a file
+ *  on disk,
+ *    epscompress( InputFile, OutputFile )
+ *  or the contents of an EPS file held in a char or uint8 array, which
+ *  returns the compressed file as an array of the same class,
+ *    Compressed = epscompress( EpsContents )
+ *  or a batch of files given as cell arrays of file names,
+ *    [Bytes,Messages] = epscompress( {In1,In2,...}, {Out1,Out2,...} )
+ *  which returns the number of bytes written to each file (-1 if it
+ *  failed) and the error messages ('' if it succeeded), rather than
+ *  stopping at the first error. If Messages isn't asked for, the errors
+ *  are given as warnings. The file mode also returns the number of
+ *  bytes written, if asked for.
+ *
+ *  The memory and file modes can also return a struct of statistics,
+ *    [Compressed,Stats] = epscompress( EpsContents )
+ *    [Bytes,Stats] = epscompress( InputFile, OutputFile )
+ *  with the bytes in and out, the number of compressed segments and of
+ *  re-encoded images, the number of times the LZW table was cleared (Resets), the average number
+ *  of table entries looked at per dictionary lookup (SearchDepth, 0 for
+ *  Flate), the seconds spent compressing, ASCII85 encoding, on file IO,
+ *  and in total, and a hash of the input as 16 hex digits (Hash). With
+ *  more than one thread, the stage times are summed over the threads.
+ *  The hash leaves out the date of the %%CreationDate comment, so an
+ *  unchanged figure printed again hashes the same.
+ *
+ *  Each form takes trailing 'Name',Value option pairs:
+ *    'method'   Compression method, 'lzw' (default) or 'flate'. Flate
+ *               gives smaller files, but needs a PostScript level 3
+ *               interpreter to read them.
+ *    'reset'    When the LZW table is cleared: 'full' (default) clears it as
+ *               soon as it fills, 'adaptive' also clears it earlier if
+ *               the compression ratio drops once the codes are 12 bits.
+ *    'ascii85'  Whether to ASCII85 encode the compressed data (default
+ *               true). Binary output is 20% smaller and quicker to write,
+ *               but leaves the EPS file no longer 7-bit clean.
+ *    'images'   Whether to re-encode the hex encoded bitmaps that the
+ *               OpenGL and Z-buffer renderers print (default false). Their
+ *               samples are compressed with the PNG predictor and Flate,
+ *               whichever the method, so this too needs level 3.
+ *    'downsample' Factor the re-encoded images are downsampled by in each
+ *               direction (default 1), averaging each block of samples,
+ *               for when a figure printed at a high resolution is too
+ *               big. The images cover the same area of the page.
+ *    'threads'  Number of threads to compress with. 0 uses one thread per
+ *               processor. The default is 1, or 0 for a batch, where the
+ *               files are spread across the threads. Otherwise, with more
+ *               than one thread, long segments are split into several
+ *               LZW streams and compressed concurrently.
+ *    'epspad'   Padding added to the bounding box, [left,bottom,right,top]
+ *               in points (default [0,0,0,0]). The bounding box comments
+ *               are rewritten as they are copied, so padding costs nothing
+ *               more than compressing.
+ *
+ *    'async'    Whether to queue the files to be compressed in the
+ *               background (default false), for the file and batch modes.
+ *               See below.
+ *
+ *  The input and output files may be the same, for compressing in place.
+ *
+ *  With 'async', the files are compressed by a background thread, in the
+ *  order they were queued, and the call returns a job number for each
+ *  file straight away,
+ *    Job = epscompress( InputFile, OutputFile, 'async', true )
+ *    Jobs = epscompress( {In1,In2,...}, {Out1,Out2,...}, 'async', true )
+ *  The default number of threads is then 0. The jobs are followed with
+ *    [Bytes,Messages] = epscompress( '-status', Jobs )
+ *  which returns the bytes written and error messages as for a batch,
+ *  with NaN bytes for jobs that haven't finished yet, and
+ *    [Bytes,Messages] = epscompress( '-wait', Jobs )
+ *  which does the same once the jobs have finished. Without Jobs,
+ *  epscompress('-status') returns the number of unfinished jobs,
+ *  epscompress('-wait') waits for all of them, and
+ *  epscompress('-wait',FileName) waits for those reading or writing that
+ *  file, e.g. before writing it again. These two give the errors of the
+ *  jobs waited for as warnings, once. Clearing the MEX file waits for the
+ *  queue to finish.
  */
 void mexFunction(int nlhs,mxArray *plhs[],int nrhs,const mxArray *prhs[])
 {
-  const char eps_magic[] = {0xc5,0xd0,0xd3,0xc6,0};
-  char str[ DSCGRACE ][ MAXSTR ];
-  int comp_state = 0;
-  int ii, jj;
+  EPS_Options o;
+  EPS_Stats stats;
+  const mxArray *cell;
+  char *buffer = NULL, *output, **files[2];
+  const char *input = NULL;
+  mxChar *chars;
+  mwSize dims[2];
+  size_t ii, n, length, *bytes;
+  int status, jj, *statuses, async = 0;
+  double *pr;
   
-  IO_State y;
-  LZW_State z;
-  
-  IO_State_Init( &y );
-  LZW_State_Init( &z );
+  EPS_Options_Init( &o );
   
   /* Sanity check the inputs */
-  if( nrhs != 2 ) mexErrMsgTxt("Two input arguments required.\n");
+  if( nrhs < 1 )
+    mexErrMsgTxt("One or two input arguments required.\n");
   
-  if( nlhs != 0 )  mexErrMsgTxt("Too many output arguments.\n");
- 
-  if ( !( mxIsChar(prhs[0]) && mxIsChar(prhs[1]) ) )
-      mexErrMsgTxt("Inputs (filenames) must both be of type string.\n.");
-  
-  y.fin = fopen( mxArrayToString( prhs[0] ), "r" );
-  if( y.fin == NULL )
-      mexErrMsgTxt("Cannot open the input file for reading.\n");
-  
-  y.fout = fopen( mxArrayToString( prhs[1] ), "w" );
-  if( y.fout == NULL )
-      mexErrMsgTxt("Cannot open the output file for writing.\n");
-  
-  /* Read the header */
-  fgets( &str[0][0], MAXSTR, y.fin );
-  if( ( strncmp( &str[0][0], "%!PS-Adobe-", 11 ) && strncmp( &str[0][0], eps_magic, 4 ) ) )
+  /* Queue commands */
+  if( IsQueueCommand( prhs[0] ) )
   {
-    fclose(y.fin);
-    fclose(y.fout);
-    mexErrMsgTxt("Input file is not an EPS file.\n");
+    QueueCommand( nlhs, plhs, nrhs, prhs );
+    return;
   }
-  fputs( &str[0][0], y.fout );
   
-  comp_state = 0;
-  while( !feof( y.fin ) )
+  /* Memory mode, with an odd number of inputs */
+  if( nrhs % 2 == 1 )
   {
-    str[0][0] = 0;
-    fgets( &str[0][0], MAXSTR, y.fin );
-    /* If compression is off */
-    if( comp_state == 0 )
+    ParseOptions( nrhs-1, prhs+1, &o, NULL );
+    if( nlhs < 1 || nlhs > 2 ) mexErrMsgTxt("One or two output arguments required.\n");
+    
+    n = mxGetNumberOfElements( prhs[0] );
+    if( mxIsUint8( prhs[0] ) )
+      input = (const char *)mxGetData( prhs[0] );
+    else if( mxIsChar( prhs[0] ) )
     {
-      /* If the next line is a DSC comment, output and continue */
-      if( !strncmp( &str[0][0], "%%", 2 ) ) fputs( &str[0][0], y.fout );
-      
-      /* Otherwise, determine if we need to start compression by scanning
-         ahead. */
-      else
-      {
-        for( ii=1; ii<DSCGRACE; ii++ )
-        {
-          /* If file ends while scanning-ahead, output what's left and finish */
-          if( feof( y.fin ) )
-          {
-            for( jj=0; jj<ii; jj++ ) fputs( &str[jj][0], y.fout );
-            fclose( y.fin );
-            fclose( y.fout );
-            return;
-          }
-          str[ii][0] = 0;
-          fgets( &str[ii][0], MAXSTR, y.fin );
-          /* If we find a comment, don't start compressing and exit. */
-          if( !strncmp( &str[ii][0], "%%", 2 ) )
-          {
-            for( jj=0; jj<=ii; jj++ ) fputs( &str[jj][0], y.fout );
-            ii = 0;
-            break;
-          }
-        }
-        /* If the loop ended without finding a comment, start compression */
-        if( ii == DSCGRACE )
-        {
-          IO_State_Init( &y );
-          LZW_State_Init( &z );
-          fprintf(y.fout,"currentfile/ASCII85Decode filter/LZWDecode filter cvx exec\n");
-          asciistreamout( CLEARTABLE, &y, &z );
-          comp_state = 1;
-          for( ii=0; ii<DSCGRACE; ii++ )
-          {
-            jj=0;
-            while( str[ii][jj] != 0 )
-            {
-              LZW( str[ii][jj], &y, &z );
-              jj++;
-            }
-          }
-        }
-      }
+      /* Narrow the characters to bytes */
+      buffer = (char *)malloc( n+1 );
+      if( buffer == NULL ) mexErrMsgTxt("Out of memory.\n");
+      chars = mxGetChars( prhs[0] );
+      for( ii=0; ii<n; ii++ ) buffer[ii] = (char)chars[ii];
+      input = buffer;
+    }
+    else mexErrMsgTxt("Input (EPS contents) must be of type char or uint8.\n");
+    
+    status = EpsCompressMemory( input, n, &output, &length, NULL, &o,
+      nlhs == 2 ? &stats : NULL );
+    free( buffer );
+    if( status != EPS_OK )
+    {
+      if( status == EPS_NOT_EPS ) mexErrMsgTxt("Input is not an EPS file.\n");
+      mexErrMsgTxt("Out of memory.\n");
+    }
+    
+    /* Return the output in the same class as the input */
+    if( mxIsUint8( prhs[0] ) )
+    {
+      plhs[0] = mxCreateNumericMatrix( 1, length, mxUINT8_CLASS, mxREAL );
+      memcpy( mxGetData( plhs[0] ), output, length );
     }
-    /* Otherwise, if compression is on. */
     else
     {
-      /* If we find a DSC comment, turn compression off */
-      if( !strncmp( &str[0][0], "%%", 2 ) )
-      {
-        NotInDictionary( 0, 0, &y, &z );
-        asciistreamout( ENDOFDATA, &y, &z );
-        asciistreamout_cleanup( &y );
-        fprintf( y.fout, "\n%s", &str[0][0] );
-        comp_state = 0;
-      }
-      /* Otherwise, keep compressing */
-      else
+      dims[0] = 1;
+      dims[1] = length;
+      plhs[0] = mxCreateCharArray( 2, dims );
+      chars = mxGetChars( plhs[0] );
+      for( ii=0; ii<length; ii++ ) chars[ii] = (unsigned char)output[ii];
+    }
+    free( output );
+    if( nlhs == 2 ) plhs[1] = StatsStruct( &stats );
+    return;
+  }
+  
+  /* Batch mode */
+  if( mxIsCell( prhs[0] ) )
+  {
+    o.Threads = 0;
+    ParseOptions( nrhs-2, prhs+2, &o, &async );
+    if( nlhs > ( async ? 1 : 2 ) ) mexErrMsgTxt("Too many output arguments.\n");
+    if( !mxIsCell( prhs[1] ) ||
+        mxGetNumberOfElements( prhs[0] ) != mxGetNumberOfElements( prhs[1] ) )
+      mexErrMsgTxt("Input and output file lists must be cell arrays of the same size.\n");
+    
+    n = mxGetNumberOfElements( prhs[0] );
+    files[0] = (char **)mxCalloc( n+1, sizeof( char * ) );
+    files[1] = (char **)mxCalloc( n+1, sizeof( char * ) );
+    statuses = (int *)mxCalloc( n+1, sizeof( int ) );
+    bytes = (size_t *)mxCalloc( n+1, sizeof( size_t ) );
+    for( ii=0; ii<n; ii++ )
+    {
+      for( jj=0; jj<2; jj++ )
       {
-        ii=0;
-        while( str[0][ ii ] != 0 )
-        {
-          LZW( str[0][ii], &y, &z );
-          ii++;
-        }
+        cell = mxGetCell( prhs[jj], ii );
+        if( cell == NULL || !mxIsChar( cell ) )
+          mexErrMsgTxt("File names must be of type string.\n");
+        files[jj][ii] = mxArrayToString( cell );
       }
     }
+    if( async )
+    {
+      plhs[0] = mxCreateDoubleMatrix( mxGetM( prhs[0] ), mxGetN( prhs[0] ), mxREAL );
+      pr = mxGetPr( plhs[0] );
+      for( ii=0; ii<n; ii++ )
+        pr[ii] = queue_add( mxGetCell( prhs[0], ii ), mxGetCell( prhs[1], ii ), &o );
+      return;
+    }
+    EpsCompressBatch( n, files[0], files[1], &o, statuses, bytes );
+    
+    /* Failed files have their byte count set to -1 */
+    plhs[0] = mxCreateDoubleMatrix( mxGetM( prhs[0] ), mxGetN( prhs[0] ), mxREAL );
+    pr = mxGetPr( plhs[0] );
+    for( ii=0; ii<n; ii++ ) pr[ii] = statuses[ii] == EPS_OK ? (double)bytes[ii] : -1;
+    
+    /* Report the errors, as messages if asked for, otherwise as warnings */
+    if( nlhs == 2 )
+      plhs[1] = mxCreateCellMatrix( mxGetM( prhs[0] ), mxGetN( prhs[0] ) );
+    for( ii=0; ii<n; ii++ )
+    {
+      if( nlhs == 2 )
+        mxSetCell( plhs[1], ii, mxCreateString( EpsErrorMessage( statuses[ii] ) ) );
+      else if( statuses[ii] != EPS_OK )
+        mexWarnMsgIdAndTxt("epscompress:batch","%s: %s",files[0][ii],
+          EpsErrorMessage( statuses[ii] ));
+      mxFree( files[0][ii] );
+      mxFree( files[1][ii] );
+    }
+    mxFree( files[0] );
+    mxFree( files[1] );
+    mxFree( statuses );
+    mxFree( bytes );
+    return;
   }
   
-  /* If we ended the file while compressing. */
-  if( comp_state == 1 )
+  /* File mode, where the default threads depend on whether it's async */
+  o.Threads = -1;
+  ParseOptions( nrhs-2, prhs+2, &o, &async );
+  if( o.Threads < 0 ) o.Threads = async ? 0 : 1;
+  if( nlhs > ( async ? 1 : 2 ) )  mexErrMsgTxt("Too many output arguments.\n");
+ 
+  if ( !( mxIsChar(prhs[0]) && mxIsChar(prhs[1]) ) )
+      mexErrMsgTxt("Inputs (filenames) must both be of type string.\n.");
+  
+  if( async )
   {
-    NotInDictionary( 0, 0, &y, &z );
-    asciistreamout( ENDOFDATA, &y, &z );
-    asciistreamout_cleanup( &y );
+    plhs[0] = mxCreateDoubleScalar( queue_add( prhs[0], prhs[1], &o ) );
+    return;
   }
   
-  /* Close the files and exit. */
-  fclose(y.fout);
-  fclose(y.fin);
+  status = EpsCompressFile( mxArrayToString( prhs[0] ), mxArrayToString( prhs[1] ),
+    NULL, &o, &n, nlhs == 2 ? &stats : NULL );
+  if( status != EPS_OK ) mexErrMsgTxt( EpsErrorMessage( status ) );
+  if( nlhs >= 1 ) plhs[0] = mxCreateDoubleScalar( (double)n );
+  if( nlhs == 2 ) plhs[1] = StatsStruct( &stats );
 }
 
 /* 
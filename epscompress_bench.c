@@ -0,0 +1,248 @@
+/** \file epscompress_bench.c
+ *
+ *  Benchmark of the EPS compressor, reporting the throughput, compression
+ *  ratio and peak memory use of each encoder mode over a corpus of EPS
+ *  files,
+ *    epscompress_bench [-r repeats] file.eps ...
+ *  Build and run it over the corpus in examples/bench (built by
+ *  examples/bench_corpus.m) with "make bench".
+ *
+ *  Each file is compressed in memory, taking the best time of the
+ *  repeats. Every measurement is run in a child process, so that the peak
+ *  resident set size (which includes the input file) is that of the one
+ *  file and mode alone. This needs fork, so is POSIX only.
+ *
+ *  See the license at the bottom of the file.
+ */
+
+/* clock_gettime is POSIX, and wait4 is BSD, so they need asking for in a
+   strict C compile */
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "epscompress_core.h"
+
+/**
+ *  An encoder mode to benchmark.
+ */
+typedef struct{
+  const char *Name;
+  int Method;
+  int Ascii85;
+  int AdaptiveReset;
+  int Threads;
+  int Images;
+} Bench_Mode;
+
+static const Bench_Mode Modes[] = {
+  { "lzw",          EPS_LZW,   1, 0, 1, 0 },
+  { "lzw-binary",   EPS_LZW,   0, 0, 1, 0 },
+  { "lzw-adaptive", EPS_LZW,   1, 1, 1, 0 },
+  { "lzw-threads",  EPS_LZW,   1, 0, 0, 0 },
+  { "flate",        EPS_FLATE, 1, 0, 1, 0 },
+  { "flate-binary", EPS_FLATE, 0, 0, 1, 0 },
+  { "flate-images", EPS_FLATE, 1, 0, 1, 1 }
+};
+#define NUMMODES ( sizeof( Modes )/sizeof( Modes[0] ) )
+
+/**
+ *  Result of compressing one file with one mode.
+ */
+typedef struct{
+  int Status;
+  size_t InLength;
+  size_t OutLength;
+  double Seconds;
+  double PeakMB;
+} Bench_Result;
+
+static double now( void )
+{
+  struct timespec t;
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/**
+ *  Read a whole file into an allocated buffer. Returns NULL on failure.
+ */
+static char *read_file( const char *filename, size_t *Length )
+{
+  FILE *fh;
+  char *buffer;
+  long length;
+
+  fh = fopen( filename, "rb" );
+  if( fh == NULL ) return NULL;
+  fseek( fh, 0, SEEK_END );
+  length = ftell( fh );
+  fseek( fh, 0, SEEK_SET );
+  buffer = length >= 0 ? (char *)malloc( length > 0 ? (size_t)length : 1 ) : NULL;
+  if( buffer != NULL ) *Length = fread( buffer, 1, (size_t)length, fh );
+  fclose( fh );
+  return buffer;
+}
+
+/**
+ *  Compress a file with a mode, in this process.
+ */
+static void bench_run( const char *filename, const Bench_Mode *m, int Repeats,
+  Bench_Result *r )
+{
+  EPS_Workspace *w;
+  EPS_Options o;
+  char *input, *output;
+  double t;
+  int ii;
+
+  memset( r, 0, sizeof( *r ) );
+  input = read_file( filename, &r->InLength );
+  if( input == NULL )
+  {
+    r->Status = EPS_CANT_READ;
+    return;
+  }
+  EPS_Options_Init( &o );
+  o.Method = m->Method;
+  o.Ascii85 = m->Ascii85;
+  o.AdaptiveReset = m->AdaptiveReset;
+  o.Threads = m->Threads;
+  o.Images = m->Images;
+  w = EPS_Workspace_Create();
+  for( ii=0; ii<Repeats && r->Status == EPS_OK; ii++ )
+  {
+    t = now();
+    r->Status = EpsCompressMemory( input, r->InLength, &output, &r->OutLength, w, &o, NULL );
+    t = now() - t;
+    if( ii == 0 || t < r->Seconds ) r->Seconds = t;
+    free( output );
+  }
+  EPS_Workspace_Destroy( w );
+  free( input );
+}
+
+/**
+ *  Compress a file with a mode in a child process, and measure its peak
+ *  memory use.
+ */
+static void bench_child( const char *filename, const Bench_Mode *m, int Repeats,
+  Bench_Result *r )
+{
+  struct rusage usage;
+  int fd[2], status;
+  pid_t pid;
+
+  memset( r, 0, sizeof( *r ) );
+  r->Status = EPS_OUT_OF_MEMORY;
+  if( pipe( fd ) != 0 ) return;
+  fflush( stdout );
+  pid = fork();
+  if( pid == 0 )
+  {
+    close( fd[0] );
+    bench_run( filename, m, Repeats, r );
+    if( write( fd[1], r, sizeof( *r ) ) != (ssize_t)sizeof( *r ) ) _exit( 1 );
+    _exit( 0 );
+  }
+  close( fd[1] );
+  if( pid > 0 )
+  {
+    if( read( fd[0], r, sizeof( *r ) ) != (ssize_t)sizeof( *r ) ) r->Status = EPS_OUT_OF_MEMORY;
+    if( wait4( pid, &status, 0, &usage ) == pid )
+      r->PeakMB = usage.ru_maxrss/1024.0;
+  }
+  close( fd[0] );
+}
+
+int main( int argc, char *argv[] )
+{
+  Bench_Result r;
+  double totalIn[ NUMMODES ], totalOut[ NUMMODES ], totalSeconds[ NUMMODES ];
+  double peak[ NUMMODES ];
+  size_t kk;
+  int ii = 1, jj, repeats = 3, failed = 0;
+
+  if( argc > 2 && strcmp( argv[1], "-r" ) == 0 )
+  {
+    repeats = atoi( argv[2] );
+    if( repeats < 1 ) repeats = 1;
+    ii = 3;
+  }
+  if( ii == argc )
+  {
+    fprintf( stderr, "Usage: epscompress_bench [-r repeats] file.eps ...\n" );
+    return EXIT_FAILURE;
+  }
+  memset( totalIn, 0, sizeof( totalIn ) );
+  memset( totalOut, 0, sizeof( totalOut ) );
+  memset( totalSeconds, 0, sizeof( totalSeconds ) );
+  memset( peak, 0, sizeof( peak ) );
+
+  printf( "%-32s %-13s %9s %7s %9s %9s\n", "file", "mode", "in (MB)", "ratio",
+    "MB/s", "peak (MB)" );
+  for( jj=ii; jj<argc; jj++ )
+  {
+    for( kk=0; kk<NUMMODES; kk++ )
+    {
+      bench_child( argv[jj], &Modes[kk], repeats, &r );
+      if( r.Status != EPS_OK )
+      {
+        printf( "%-32s %-13s %s\n", argv[jj], Modes[kk].Name, EpsErrorMessage( r.Status ) );
+        failed = 1;
+        continue;
+      }
+      printf( "%-32s %-13s %9.2f %7.3f %9.1f %9.1f\n", argv[jj], Modes[kk].Name,
+        r.InLength/1e6, r.InLength ? (double)r.OutLength/r.InLength : 0.0,
+        r.Seconds > 0 ? r.InLength/1e6/r.Seconds : 0.0, r.PeakMB );
+      totalIn[kk] += r.InLength;
+      totalOut[kk] += r.OutLength;
+      totalSeconds[kk] += r.Seconds;
+      if( r.PeakMB > peak[kk] ) peak[kk] = r.PeakMB;
+    }
+  }
+
+  /* Totals over the corpus for each mode */
+  printf( "\n" );
+  for( kk=0; kk<NUMMODES; kk++ )
+    printf( "%-32s %-13s %9.2f %7.3f %9.1f %9.1f\n", "total", Modes[kk].Name,
+      totalIn[kk]/1e6, totalIn[kk] > 0 ? totalOut[kk]/totalIn[kk] : 0.0,
+      totalSeconds[kk] > 0 ? totalIn[kk]/1e6/totalSeconds[kk] : 0.0, peak[kk] );
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ Copyright (c) 2010, Zebb Prime
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+     * Neither the name of the organisation nor the
+       names of its contributors may be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL ZEBB PRIME BE LIABLE FOR ANY
+ DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
@@ -0,0 +1,220 @@
+/** \file epscompress_cli.c
+ *
+ *  Command line interface to the EPS compressor,
+ *    epscompress [options] [input [output]]
+ *  The input is read from stdin and the output written to stdout if they
+ *  are not given (or are given as -), so that it can be used as a filter.
+ *  Build with "make cli", or
+ *    cc -O2 -o epscompress epscompress_cli.c epscompress_core.c -lpthread
+ *
+ *  See the license at the bottom of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "epscompress_core.h"
+
+static const char *Usage =
+  "Usage: epscompress [options] [input [output]]\n"
+  "Compress the segments of an EPS file between its DSC comments. The\n"
+  "input and output default to stdin and stdout, as does a name of -.\n"
+  "\n"
+  "  -m, --method lzw|flate   Compression method (default lzw). Flate is\n"
+  "                           smaller, but needs a level 3 interpreter.\n"
+  "  -r, --reset full|adaptive\n"
+  "                           When the LZW table is cleared (default full).\n"
+  "  -b, --binary             Don't ASCII85 encode the compressed data.\n"
+  "  -i, --images             Re-encode hex images with the PNG predictor\n"
+  "                           and Flate (needs a level 3 interpreter).\n"
+  "  -d, --downsample N       Downsample the re-encoded images by a factor\n"
+  "                           of N, 1 to 64 (default 1).\n"
+  "  -t, --threads N          Number of threads, 0 for one per processor\n"
+  "                           (default 1).\n"
+  "  -p, --pad L,B,R,T        Pad the bounding box by these many points.\n"
+  "  -s, --stats              Report where the time went, and a hash of\n"
+  "                           the input, on stderr.\n"
+  "  -h, --help               Show this message.\n";
+
+/**
+ *  Report an error and exit.
+ */
+static void fail( const char *name, const char *message )
+{
+  if( name != NULL ) fprintf( stderr, "epscompress: %s: %s\n", name, message );
+  else fprintf( stderr, "epscompress: %s\n", message );
+  exit( EXIT_FAILURE );
+}
+
+/**
+ *  Report the statistics of a compression.
+ */
+static void print_stats( const EPS_Stats *s )
+{
+  fprintf( stderr, "epscompress: %lu -> %lu bytes, %lu segments, %lu images, "
+    "%llu table resets, search depth %.2f\n", (unsigned long)s->BytesIn,
+    (unsigned long)s->BytesOut, (unsigned long)s->Segments, (unsigned long)s->Images, s->Resets,
+    s->Lookups ? 1.0 + (double)s->Probes/(double)s->Lookups : 0.0 );
+  fprintf( stderr, "epscompress: %.3f s total: %.3f s compress, %.3f s ASCII85, "
+    "%.3f s IO\n", s->TotalSeconds, s->CompressSeconds, s->Ascii85Seconds,
+    s->IoSeconds );
+  fprintf( stderr, "epscompress: input hash %016llx\n", s->Hash );
+}
+
+/**
+ *  Test whether argument x is the option with the given short and long
+ *  names.
+ */
+static int is_option( const char *x, const char *Short, const char *Long )
+{
+  return strcmp( x, Short ) == 0 || strcmp( x, Long ) == 0;
+}
+
+int main( int argc, char *argv[] )
+{
+  EPS_Options o;
+  EPS_Stats stats, *pstats = NULL;
+  const char *files[2] = { "-", "-" };
+  const char *value;
+  char *end;
+  size_t bytes;
+  long threads, factor;
+  int ii, jj, numFiles = 0, status;
+
+  EPS_Options_Init( &o );
+  for( ii=1; ii<argc; ii++ )
+  {
+    if( argv[ii][0] != '-' || argv[ii][1] == '\0' )
+    {
+      if( numFiles == 2 ) fail( NULL, "Too many file names." );
+      files[ numFiles++ ] = argv[ii];
+      continue;
+    }
+    if( is_option( argv[ii], "-h", "--help" ) )
+    {
+      fputs( Usage, stdout );
+      return EXIT_SUCCESS;
+    }
+    if( is_option( argv[ii], "-b", "--binary" ) )
+    {
+      o.Ascii85 = 0;
+      continue;
+    }
+    if( is_option( argv[ii], "-i", "--images" ) )
+    {
+      o.Images = 1;
+      continue;
+    }
+    if( is_option( argv[ii], "-s", "--stats" ) )
+    {
+      pstats = &stats;
+      continue;
+    }
+
+    /* The rest of the options take a value */
+    if( !( is_option( argv[ii], "-m", "--method" ) ||
+           is_option( argv[ii], "-r", "--reset" ) ||
+           is_option( argv[ii], "-t", "--threads" ) ||
+           is_option( argv[ii], "-d", "--downsample" ) ||
+           is_option( argv[ii], "-p", "--pad" ) ) )
+    {
+      fprintf( stderr, "%s", Usage );
+      fail( argv[ii], "Unknown option." );
+    }
+    if( ii+1 == argc ) fail( argv[ii], "Missing value." );
+    value = argv[ii+1];
+    if( is_option( argv[ii], "-m", "--method" ) )
+    {
+      if( strcmp( value, "lzw" ) == 0 ) o.Method = EPS_LZW;
+      else if( strcmp( value, "flate" ) == 0 ) o.Method = EPS_FLATE;
+      else fail( value, "Unknown method." );
+    }
+    else if( is_option( argv[ii], "-r", "--reset" ) )
+    {
+      if( strcmp( value, "full" ) == 0 ) o.AdaptiveReset = 0;
+      else if( strcmp( value, "adaptive" ) == 0 ) o.AdaptiveReset = 1;
+      else fail( value, "Unknown reset policy." );
+    }
+    else if( is_option( argv[ii], "-p", "--pad" ) )
+    {
+      for( jj=0; jj<4; jj++ )
+      {
+        o.Pad[jj] = (int)strtol( value, &end, 10 );
+        if( end == value || *end != ( jj < 3 ? ',' : '\0' ) )
+          fail( argv[ii+1], "The padding must be four integers, L,B,R,T." );
+        value = end+1;
+      }
+    }
+    else if( is_option( argv[ii], "-d", "--downsample" ) )
+    {
+      factor = strtol( value, &end, 10 );
+      if( *value == '\0' || *end != '\0' || factor < 1 || factor > MAXDOWNSAMPLE )
+        fail( value, "The downsample factor must be an integer from 1 to 64." );
+      o.Downsample = (int)factor;
+    }
+    else
+    {
+      threads = strtol( value, &end, 10 );
+      if( *value == '\0' || *end != '\0' || threads < 0 )
+        fail( value, "The number of threads must be a non-negative integer." );
+      o.Threads = threads > MAXTHREADS ? MAXTHREADS : (int)threads;
+    }
+    ii++;
+  }
+
+  if( strcmp( files[0], "-" ) != 0 && strcmp( files[1], "-" ) != 0 )
+  {
+    status = EpsCompressFile( files[0], files[1], NULL, &o, &bytes, pstats );
+    if( status != EPS_OK )
+      fail( files[ status == EPS_CANT_WRITE ], EpsErrorMessage( status ) );
+    if( pstats != NULL ) print_stats( pstats );
+    return EXIT_SUCCESS;
+  }
+
+  /* Otherwise at least one end is a stream */
+#ifdef _WIN32
+  _setmode( _fileno( stdin ), _O_BINARY );
+  _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+  if( strcmp( files[0], "-" ) != 0 && freopen( files[0], "rb", stdin ) == NULL )
+    fail( files[0], EpsErrorMessage( EPS_CANT_READ ) );
+  if( strcmp( files[1], "-" ) != 0 && freopen( files[1], "wb", stdout ) == NULL )
+    fail( files[1], EpsErrorMessage( EPS_CANT_WRITE ) );
+  status = EpsCompressStream( stdin, stdout, NULL, &o, &bytes, pstats );
+  if( status != EPS_OK )
+    fail( strcmp( files[0], "-" ) != 0 ? files[0] : NULL, EpsErrorMessage( status ) );
+  if( fclose( stdout ) != 0 ) fail( NULL, EpsErrorMessage( EPS_WRITE_ERROR ) );
+  if( pstats != NULL ) print_stats( pstats );
+  return EXIT_SUCCESS;
+}
+
+/*
+ Copyright (c) 2010, Zebb Prime
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+     * Neither the name of the organisation nor the
+       names of its contributors may be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL ZEBB PRIME BE LIABLE FOR ANY
+ DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
@@ -0,0 +1,3578 @@
+/** \file epscompress_core.c
+ *
+ *  Compresses an EPS file generated from Matlab using the LZW
+ *  algorithm. This is the core of the compressor, shared by the MEX
+ *  function (epscompress.c) and the command line tool (epscompress_cli.c);
+ *  see epscompress_core.h for the interface.
+ *
+ *  According to most sources, the patents for LZW compression expired
+ *  around 2003--2004.  If this is incorrect, please let the author know.
+ *  
+ *  This particular algorithm uses an open-addressed hash table, keyed on
+ *  the (prefix,character) pair, to determine if a string exists in the
+ *  dictionary.
+ *
+ *  Version 0.2 10-Sep-2010
+ *
+ *  See the license at the bottom of the file.
+ */
+
+/* clock_gettime, mmap and the like are POSIX, so aren't declared by a
+   strict C compile (e.g. -std=c99) without asking for them. macOS then
+   hides its extensions, which sysconf's processor count is one of,
+   unless they are asked for too. */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define HAVE_AVX2
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#define HAVE_NEON
+#include <arm_neon.h>
+#endif
+#include "epscompress_core.h"
+
+/* Maximum table size, 2^MaxBits */
+#define TABLESIZE 4096
+/* Hash table size. Must be a power of two, and at least twice TABLESIZE
+   to keep the probe sequences short. */
+#define HASHSIZE 8192
+#define HASHMASK (HASHSIZE-1)
+/* Hash of a (prefix,character) key; Fibonacci hashing down to 13 bits. */
+#define LZW_HASH(k) ( ( (k)*2654435761u ) >> 19 )
+/* Max/Min output bit sizes. */
+#define BITMAX 12
+#define BITMIN 9
+/* Special input/output values. */
+#define CLEARTABLE 256
+#define ENDOFDATA 257
+/* First free location in the index. */
+#define FIRSTFREE 258
+/* With the adaptive reset, number of input characters between checks of
+   the compression ratio once the codes are BITMAX bits wide */
+#define CHECKGAP 1000
+/* Maximum output width. */
+#define OUTPUTWIDTH 75
+/* Number of lines between DSC comments before compression starts */
+#define DSCGRACE 10
+/* Characters of a long line that count as one line towards DSCGRACE, so
+   that a few long lines (such as image data) are still compressed */
+#define DSCGRACELINE 1023
+/* Space for the look-ahead in the window of a streamed input. Counting
+   long lines as above, it holds back at most DSCGRACE*DSCGRACELINE
+   characters. */
+#define DSCGRACESIZE (1<<20)
+/* Size of the blocks that long runs of input are written out in, while
+   they are still in the cache */
+#define SEGBLOCKSIZE (1<<16)
+/* Longest bounding box comment that is padded, and the space for its
+   rewritten values */
+#define BBOXLINE 256
+#define BBOXVALUE 64
+/* Longest image header line that is recognised, longest name of the
+   string an image is read into, and the most samples re-encoded in one
+   image */
+#define IMAGEHEADER 256
+#define IMAGENAME 64
+#define IMAGEMAXSAMPLES (1UL<<28)
+/* FNV-1a parameters of the input hash, and the comment left out of it */
+#define FNVOFFSET 14695981039346656037ULL
+#define FNVPRIME 1099511628211ULL
+#define HASHSKIP "%%CreationDate:"
+#define HASHSKIPLENGTH ( (int)sizeof( HASHSKIP ) - 1 )
+/* Size of the output staging buffer when writing to a file */
+#define IOBLOCKSIZE (1<<20)
+/* Number of 32-bit words collected before they are ASCII85 encoded */
+#define A85BATCH 256
+/* Division by 85 as a multiply-shift, exact for all 32-bit values */
+#define A85MAGIC 0xC0C0C0C1u
+#define A85SHIFT 38
+/* Header written in front of each compressed segment */
+#define LZW_HEADER "currentfile/ASCII85Decode filter/LZWDecode filter cvx exec\n"
+#define LZW_BINARY_HEADER "currentfile/LZWDecode filter cvx exec\n"
+/* When compressing in parallel, segments longer than this are split into
+   several LZW streams where it is safe to do so */
+#define SPLITSIZE (1<<20)
+/* Header written in front of each Flate compressed segment */
+#define FLATE_HEADER "currentfile/ASCII85Decode filter/FlateDecode filter cvx exec\n"
+#define FLATE_BINARY_HEADER "currentfile/FlateDecode filter cvx exec\n"
+/* Replacement for an image header, reading the re-encoded samples that
+   follow the newline: the length of the data, the ASCII85 filter if any,
+   width, colours, width, height, matrix and image operator */
+#define IMAGE_HEADER "currentfile %lu()/SubFileDecode filter dup%s" \
+  "<</Predictor 15/Columns %lu/Colors %d/BitsPerComponent 8>>/FlateDecode filter" \
+  "{%lu %lu 8 %s 5 -1 roll %s flushfile}exec\n"
+/* Deflate window size, and the size of the hash table used to find
+   matches in it */
+#define FLATEWINDOW 32768
+#define FLATEHASHSIZE 32768
+/* Minimum and maximum match lengths */
+#define FLATEMINMATCH 3
+#define FLATEMAXMATCH 258
+/* Look-ahead needed before searching for a match, and the resulting
+   maximum match distance so that matches survive the window sliding */
+#define FLATELOOKAHEAD ( FLATEMAXMATCH + FLATEMINMATCH + 1 )
+#define FLATEMAXDIST ( FLATEWINDOW - FLATELOOKAHEAD )
+/* Matching effort, as per zlib's default level */
+#define FLATECHAIN 128
+#define FLATELAZY 16
+#define FLATEGOOD 8
+#define FLATENICE 128
+/* Number of symbols collected before a block is written */
+#define FLATESYMBOLS 16384
+
+/**
+ *  A single dictionary entry. The (prefix,character) pair is stored in
+ *  Key as (prefix<<8 | character). An entry is only in use if its Epoch
+ *  matches the Epoch of the LZW_State, so that clearing the table is just
+ *  a matter of starting a new epoch.
+ */
+typedef struct{
+  unsigned int Key;
+  unsigned short Code;
+  unsigned short Epoch;
+} LZW_Entry;
+
+/**
+ *  Structure containing information about the current LZW
+ *  compression state.
+ */
+typedef struct{
+  /* Dictionary hash table, and the current epoch of its entries */
+  LZW_Entry Table[ HASHSIZE ];
+  unsigned short Epoch;
+  /* Current character being processed. */
+  unsigned char CurrentChar;
+  /* Current index (equivalent to the prefix). */
+  int CurrentIndex;
+  /* Next free index. */
+  unsigned int NextIndex;
+  /* Variable to store the maximum index for the current bitsize */
+  unsigned int MaxIndex;
+  /* Current output bitsize. */
+  unsigned int BitSize;  
+  /* Set to also clear the table before it is full, once the compression
+     ratio drops, as well as when it fills. */
+  int Adaptive;
+  /* Input characters and output bits since the table was last cleared,
+     and their values at the last check of the compression ratio. */
+  unsigned long long InCount;
+  unsigned long long OutBits;
+  unsigned long long CheckIn;
+  unsigned long long CheckBits;
+  /* Counts for the statistics, kept across table clears: dictionary
+     lookups, the extra entries they probed, and table clears. */
+  unsigned long long Lookups;
+  unsigned long long Probes;
+  unsigned long long Resets;
+} LZW_State;
+
+/**
+ *  Structure containing information about the IO state. The input is
+ *  either held in memory (mapped, in the case of a file), or (if the input
+ *  file pointer is set) streamed through a fixed size window of it. Output
+ *  either goes through the output file pointer, or (if it is NULL) to the
+ *  memory buffer. When writing to a file, the output buffer is a fixed
+ *  size staging buffer which is flushed in large blocks.
+ */
+typedef struct{
+  /* Input and output file pointers */
+  FILE *fin;
+  FILE *fout;
+  /* Input memory buffer, or the window of a streamed input */
+  const char *InBuffer;
+  size_t InLength;
+  /* Set once there is no more input to read into the window */
+  int InEof;
+  /* Set if reading the input stream failed */
+  int ReadError;
+  /* Memory mapped (or, failing that, allocated) copy of the input file,
+     or the window of a streamed input */
+  void *InMapping;
+  int InMappingIsAllocated;
+  /* Output memory buffer, grown as required (or flushed if writing to a
+     file). */
+  char *OutBuffer;
+  size_t OutLength;
+  size_t OutCapacity;
+  /* Total number of characters written to the output */
+  size_t OutTotal;
+  /* Set if the output memory buffer could not be grown */
+  int OutOfMemory;
+  /* Set if writing to the output file failed */
+  int WriteError;
+  /* Set to write the compressed data as binary, rather than ASCII85 */
+  int Binary;
+  /* 32-bit words waiting to be ASCII85 encoded */
+  unsigned int Words[ A85BATCH ];
+  unsigned int NumWords;
+  unsigned int Storage;
+  unsigned int ColumnWidth;
+  int StorageIndex;
+  /* Statistics to gather, or NULL */
+  EPS_Stats *Stats;
+  /* Characters of HASHSKIP matched at the start of the current input
+     line, or -1 past the start of a line that doesn't match */
+  int HashMatch;
+} IO_State;
+
+/**
+ *  Structure containing information about the current Flate (deflate,
+ *  with a zlib wrapper) compression state. Input is gathered into a
+ *  window of twice FLATEWINDOW, which slides down as it fills.
+ */
+typedef struct{
+  /* Input window, and the hash chains of the 3 byte strings in it.
+     Positions are offsets into the window, with 0 meaning none. */
+  unsigned char Window[ 2*FLATEWINDOW ];
+  unsigned short Head[ FLATEHASHSIZE ];
+  unsigned short Prev[ FLATEWINDOW ];
+  /* Current position, and the end of the input in the window */
+  unsigned int Position;
+  unsigned int End;
+  /* Lazy matching state */
+  unsigned int MatchLength;
+  unsigned int MatchStart;
+  unsigned int PrevLength;
+  unsigned int PrevMatch;
+  int MatchAvailable;
+  /* Adler-32 checksum of the input */
+  unsigned int Adler1;
+  unsigned int Adler2;
+  /* Symbols of the current block (literals, or match lengths-3 with a
+     non-zero distance), and their frequencies */
+  unsigned char SymLength[ FLATESYMBOLS ];
+  unsigned short SymDistance[ FLATESYMBOLS ];
+  unsigned int NumSymbols;
+  unsigned int LitFreq[ 288 ];
+  unsigned int DistFreq[ 32 ];
+  /* Fixed Huffman codes */
+  unsigned char FixedLengths[ 288 ];
+  unsigned int FixedCodes[ 288 ];
+  /* Output bits, written least significant bit first */
+  unsigned long long BitBuffer;
+  unsigned int BitCount;
+} Flate_State;
+
+/**
+ *  Initialise LZW_State data structure. The table is emptied by moving to
+ *  the next epoch; only when the epoch wraps around does it need clearing.
+ *  The structure must have been zeroed when allocated. The reset policy
+ *  (Adaptive) is left as it is.
+ */
+static void LZW_State_Init( LZW_State *x )
+{
+  if( ++x->Epoch == 0 )
+  {
+    memset( x->Table, 0, sizeof( x->Table ) );
+    x->Epoch = 1;
+  }
+  x->CurrentChar = 0;
+  x->CurrentIndex = -1;
+  x->NextIndex = FIRSTFREE;
+  x->MaxIndex = (1<<BITMIN);
+  x->BitSize = BITMIN;
+  x->InCount = 0;
+  x->OutBits = 0;
+  x->CheckIn = 0;
+  x->CheckBits = 0;
+}
+
+/**
+ *  Initialise IO_State data structure. The file pointer
+ *  and memory buffers need to be initialised
+ *  seperately, see IO_State_Clear.
+ */
+static void IO_State_Init( IO_State *x )
+{
+  x->Storage = 0;
+  x->ColumnWidth = 0;
+  x->StorageIndex = 0;
+  x->NumWords = 0;
+}
+
+/**
+ *  Clear the file pointers and memory buffers of an IO_State data
+ *  structure, then initialise it.
+ */
+static void IO_State_Clear( IO_State *x )
+{
+  memset( x, 0, sizeof( *x ) );
+  IO_State_Init( x );
+}
+
+/**
+ *  Wall clock time in seconds, for timing the stages.
+ */
+static double eps_clock( void )
+{
+#ifdef _WIN32
+  LARGE_INTEGER t, f;
+  
+  QueryPerformanceCounter( &t );
+  QueryPerformanceFrequency( &f );
+  return (double)t.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec t;
+  
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + 1e-9*t.tv_nsec;
+#endif
+}
+
+/**
+ *  Start timing a stage, if statistics are being gathered.
+ */
+static double stats_start( IO_State *y )
+{
+  return y->Stats != NULL ? eps_clock() : 0;
+}
+
+/**
+ *  Add the time since Start to the IO time.
+ */
+static void stats_io( IO_State *y, double Start )
+{
+  if( y->Stats != NULL ) y->Stats->IoSeconds += eps_clock() - Start;
+}
+
+/**
+ *  Add n characters of input to the FNV-1a hash of the statistics. The
+ *  rest of a %%CreationDate line is left out, so that printing the same
+ *  figure again gives the same hash.
+ */
+static void stats_hash( IO_State *y, const char *x, size_t n )
+{
+  unsigned long long h;
+  size_t ii;
+  int match = y->HashMatch;
+  char c;
+  
+  if( y->Stats == NULL ) return;
+  h = y->Stats->Hash;
+  for( ii=0; ii<n; ii++ )
+  {
+    c = x[ii];
+    if( c == '\n' || c == '\r' ) match = 0;
+    else if( match == HASHSKIPLENGTH ) continue;
+    else if( match >= 0 ) match = c == HASHSKIP[ match ] ? match+1 : -1;
+    h = ( h ^ (unsigned char)c )*FNVPRIME;
+  }
+  y->Stats->Hash = h;
+  y->HashMatch = match;
+}
+
+/**
+ *  The compression stage is timed as whatever isn't spent in the other
+ *  stages, so its timer keeps their times at the start.
+ */
+typedef struct{
+  double Start;
+  double Ascii85;
+  double Io;
+} Stats_Timer;
+
+static void stats_timer_start( IO_State *y, Stats_Timer *t )
+{
+  if( y->Stats == NULL ) return;
+  t->Start = eps_clock();
+  t->Ascii85 = y->Stats->Ascii85Seconds;
+  t->Io = y->Stats->IoSeconds;
+}
+
+static void stats_timer_stop( IO_State *y, Stats_Timer *t )
+{
+  if( y->Stats == NULL ) return;
+  y->Stats->CompressSeconds += eps_clock() - t->Start -
+    ( y->Stats->Ascii85Seconds - t->Ascii85 ) - ( y->Stats->IoSeconds - t->Io );
+}
+
+/**
+ *  Read more of a streamed input into its window, after discarding the
+ *  characters before Keep. Offsets into the window move down by the
+ *  returned amount. Once there is nothing more to read (always the case
+ *  for input held in memory), InEof is set.
+ */
+static size_t io_read_more( IO_State *y, size_t Keep )
+{
+  char *window = (char *)y->InMapping;
+  size_t n;
+  double t;
+  
+  if( y->fin == NULL || y->InEof )
+  {
+    y->InEof = 1;
+    return 0;
+  }
+  t = stats_start( y );
+  memmove( window, window + Keep, y->InLength - Keep );
+  y->InLength -= Keep;
+  n = fread( window + y->InLength, 1, DSCGRACESIZE + IOBLOCKSIZE - y->InLength, y->fin );
+  if( n == 0 )
+  {
+    if( ferror( y->fin ) ) y->ReadError = 1;
+    y->InEof = 1;
+  }
+  stats_hash( y, window + y->InLength, n );
+  y->InLength += n;
+  if( y->Stats != NULL ) y->Stats->BytesIn += n;
+  stats_io( y, t );
+  return Keep;
+}
+
+/**
+ *  Read the rest of a stream into an allocated input buffer. Returns 0
+ *  on success.
+ */
+static int io_read_stream( FILE *fh, IO_State *y )
+{
+  size_t capacity = IOBLOCKSIZE, n;
+  char *buffer, *newBuffer;
+  
+  buffer = (char *)malloc( capacity );
+  if( buffer == NULL ) return 1;
+  y->InLength = 0;
+  while( ( n = fread( buffer + y->InLength, 1, capacity - y->InLength, fh ) ) > 0 )
+  {
+    y->InLength += n;
+    if( y->InLength < capacity ) continue;
+    newBuffer = (char *)realloc( buffer, 2*capacity );
+    if( newBuffer == NULL )
+    {
+      free( buffer );
+      return 1;
+    }
+    buffer = newBuffer;
+    capacity *= 2;
+  }
+  if( ferror( fh ) )
+  {
+    free( buffer );
+    return 1;
+  }
+  y->InMapping = buffer;
+  y->InMappingIsAllocated = 1;
+  y->InBuffer = buffer;
+  y->InEof = 0;
+  return 0;
+}
+
+/**
+ *  Stream the input from fh, through a window of DSCGRACESIZE+IOBLOCKSIZE
+ *  characters. Returns 0 on success.
+ */
+static int io_stream_input( FILE *fh, IO_State *y )
+{
+  y->InMapping = malloc( DSCGRACESIZE + IOBLOCKSIZE );
+  if( y->InMapping == NULL ) return 1;
+  y->InMappingIsAllocated = 1;
+  y->fin = fh;
+  y->InBuffer = (const char *)y->InMapping;
+  y->InLength = 0;
+  y->InEof = 0;
+  return 0;
+}
+
+/**
+ *  Test for the end of the input, once there is nothing more to read.
+ */
+static int io_eof( IO_State *y )
+{
+  return y->InEof;
+}
+
+/**
+ *  Write out the contents of the output staging buffer.
+ */
+static void io_flush( IO_State *y )
+{
+  double t;
+  
+  if( y->fout == NULL || y->OutLength == 0 ) return;
+  t = stats_start( y );
+  if( fwrite( y->OutBuffer, 1, y->OutLength, y->fout ) != y->OutLength )
+    y->WriteError = 1;
+  y->OutLength = 0;
+  stats_io( y, t );
+}
+
+/**
+ *  Append a block of characters to the output.
+ */
+static void io_write( const char *x, size_t n, IO_State *y )
+{
+  size_t newCapacity;
+  char *newBuffer;
+  double t;
+  
+  y->OutTotal += n;
+  if( y->OutLength + n > y->OutCapacity )
+  {
+    if( y->fout != NULL )
+    {
+      io_flush( y );
+      /* Blocks larger than the staging buffer go straight to the file. */
+      if( n > y->OutCapacity )
+      {
+        t = stats_start( y );
+        if( fwrite( x, 1, n, y->fout ) != n ) y->WriteError = 1;
+        stats_io( y, t );
+        return;
+      }
+    }
+    else
+    {
+      if( y->OutOfMemory ) return;
+      newCapacity = y->OutCapacity ? y->OutCapacity : 4096;
+      while( newCapacity < y->OutLength + n ) newCapacity *= 2;
+      newBuffer = (char *)realloc( y->OutBuffer, newCapacity );
+      if( newBuffer == NULL )
+      {
+        y->OutOfMemory = 1;
+        return;
+      }
+      y->OutBuffer = newBuffer;
+      y->OutCapacity = newCapacity;
+    }
+  }
+  memcpy( y->OutBuffer + y->OutLength, x, n );
+  y->OutLength += n;
+}
+
+/**
+ *  Map the whole input file into memory, and use it as the input buffer.
+ *  If the file can't be mapped (e.g. it is empty, or a pipe), it is
+ *  streamed if Stream is set, or otherwise read into an allocated buffer.
+ *  Returns 0 on success.
+ */
+static int io_open_input( const char *filename, IO_State *y, int Stream )
+{
+  FILE *fh;
+#ifdef _WIN32
+  HANDLE hFile, hMapping;
+  LARGE_INTEGER size;
+  
+  hFile = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+  if( hFile == INVALID_HANDLE_VALUE ) return 1;
+  if( GetFileSizeEx( hFile, &size ) && size.QuadPart > 0 )
+  {
+    hMapping = CreateFileMappingA( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+    if( hMapping != NULL )
+    {
+      y->InMapping = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+      /* The view keeps the mapping alive once the handles are closed. */
+      CloseHandle( hMapping );
+      if( y->InMapping != NULL ) y->InLength = (size_t)size.QuadPart;
+    }
+  }
+  CloseHandle( hFile );
+#else
+  int fd;
+  struct stat sb;
+  void *map;
+  
+  fd = open( filename, O_RDONLY );
+  if( fd < 0 ) return 1;
+  if( fstat( fd, &sb ) == 0 && sb.st_size > 0 )
+  {
+    map = mmap( NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if( map != MAP_FAILED )
+    {
+#ifdef POSIX_MADV_SEQUENTIAL
+      posix_madvise( map, (size_t)sb.st_size, POSIX_MADV_SEQUENTIAL );
+#endif
+      y->InMapping = map;
+      y->InLength = (size_t)sb.st_size;
+    }
+  }
+  close( fd );
+#endif
+  if( y->InMapping == NULL )
+  {
+    /* Fall back to streaming, or reading the whole file. */
+    fh = fopen( filename, "rb" );
+    if( fh == NULL ) return 1;
+    if( Stream ? io_stream_input( fh, y ) : io_read_stream( fh, y ) )
+    {
+      fclose( fh );
+      return 1;
+    }
+    /* A streamed file is closed along with the input */
+    if( !Stream ) fclose( fh );
+    return 0;
+  }
+  y->InBuffer = (const char *)y->InMapping;
+  y->InEof = 0;
+  return 0;
+}
+
+/**
+ *  Release the input file mapping, and close the input file if it was
+ *  being streamed.
+ */
+static void io_close_input( IO_State *y )
+{
+  if( y->fin != NULL ) fclose( y->fin );
+  y->fin = NULL;
+  if( y->InMapping == NULL ) return;
+  if( y->InMappingIsAllocated ) free( y->InMapping );
+#ifdef _WIN32
+  else UnmapViewOfFile( y->InMapping );
+#else
+  else munmap( y->InMapping, y->InLength );
+#endif
+  y->InMapping = NULL;
+  y->InBuffer = NULL;
+}
+
+/**
+ *  Test whether two file names refer to the same (existing) file.
+ */
+static int io_same_file( const char *a, const char *b )
+{
+#ifdef _WIN32
+  BY_HANDLE_FILE_INFORMATION ia, ib;
+  HANDLE ha, hb;
+  int same = 0;
+  
+  ha = CreateFileA( a, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    NULL, OPEN_EXISTING, 0, NULL );
+  hb = CreateFileA( b, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    NULL, OPEN_EXISTING, 0, NULL );
+  if( ha != INVALID_HANDLE_VALUE && hb != INVALID_HANDLE_VALUE &&
+      GetFileInformationByHandle( ha, &ia ) && GetFileInformationByHandle( hb, &ib ) )
+    same = ia.dwVolumeSerialNumber == ib.dwVolumeSerialNumber &&
+      ia.nFileIndexHigh == ib.nFileIndexHigh && ia.nFileIndexLow == ib.nFileIndexLow;
+  if( ha != INVALID_HANDLE_VALUE ) CloseHandle( ha );
+  if( hb != INVALID_HANDLE_VALUE ) CloseHandle( hb );
+  return same;
+#else
+  struct stat sa, sb;
+  
+  return stat( a, &sa ) == 0 && stat( b, &sb ) == 0 &&
+    sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+}
+
+/**
+ *  Replace the file To with From. Returns 0 on success.
+ */
+static int io_replace_file( const char *From, const char *To )
+{
+#ifdef _WIN32
+  return !MoveFileExA( From, To, MOVEFILE_REPLACE_EXISTING );
+#else
+  return rename( From, To ) != 0;
+#endif
+}
+
+/**
+ *  Open the output file, and allocate the staging buffer if there isn't
+ *  one already. Returns 0 on success.
+ */
+static int io_open_output( const char *filename, IO_State *y )
+{
+  if( y->OutBuffer == NULL )
+  {
+    y->OutBuffer = (char *)malloc( IOBLOCKSIZE );
+    if( y->OutBuffer == NULL ) return 1;
+    y->OutCapacity = IOBLOCKSIZE;
+  }
+  y->fout = fopen( filename, "wb" );
+  if( y->fout == NULL ) return 1;
+  y->OutLength = 0;
+  y->OutTotal = 0;
+  return 0;
+}
+
+/**
+ *  Flush the staging buffer and close the output file. Returns 0 on
+ *  success. The staging buffer is kept, so that it can be reused for the
+ *  next file, and must be freed by the caller.
+ */
+static int io_close_output( IO_State *y )
+{
+  io_flush( y );
+  if( fclose( y->fout ) != 0 ) y->WriteError = 1;
+  y->fout = NULL;
+  return y->WriteError;
+}
+
+/**
+ *  Append a single character or a string to the output.
+ */
+static void io_putc( char x, IO_State *y )
+{
+  io_write( &x, 1, y );
+}
+
+static void io_puts( const char *x, IO_State *y )
+{
+  io_write( x, strlen( x ), y );
+}
+
+/**
+ *  ASCII85 encoding kernels. Each converts n 32-bit words into 5 digits
+ *  per word (already offset by '!'), placing the first four digits of
+ *  word ii in the bytes of Hi[ii] (first digit in the lowest byte) and
+ *  the last digit in Lo[ii]. The '!' digits of zero words are replaced by
+ *  'z' later.
+ */
+typedef void (*a85_kernel)( const unsigned int *Words, unsigned int n,
+  unsigned int *Hi, unsigned char *Lo );
+
+/**
+ *  Scalar kernel, also used for the words left over by the vector kernels.
+ *  Uses the multiply-shift form of the division by 85.
+ */
+static void a85_kernel_scalar( const unsigned int *Words, unsigned int n,
+  unsigned int *Hi, unsigned char *Lo )
+{
+  unsigned int ii, v, q, d4, d3, d2, d1;
+  
+  for( ii=0; ii<n; ii++ )
+  {
+    v = Words[ii];
+    q = (unsigned int)( ( (unsigned long long)v*A85MAGIC ) >> A85SHIFT );
+    d4 = v - q*85;
+    v = (unsigned int)( ( (unsigned long long)q*A85MAGIC ) >> A85SHIFT );
+    d3 = q - v*85;
+    q = (unsigned int)( ( (unsigned long long)v*A85MAGIC ) >> A85SHIFT );
+    d2 = v - q*85;
+    v = (unsigned int)( ( (unsigned long long)q*A85MAGIC ) >> A85SHIFT );
+    d1 = q - v*85;
+    /* v is now the leading digit, which is always less than 85. */
+    Hi[ii] = ( v | (d1<<8) | (d2<<16) | (d3<<24) ) + 0x21212121u;
+    Lo[ii] = (unsigned char)( d4+33 );
+  }
+}
+
+#ifdef HAVE_SSE2
+/* Four lanes of x/85. _mm_mul_epu32 only multiplies the even lanes, so
+   the odd lanes are shifted down and done seperately. */
+static __m128i a85_div85_sse2( __m128i x )
+{
+  const __m128i magic = _mm_set1_epi32( (int)A85MAGIC );
+  __m128i even, odd;
+  
+  even = _mm_srli_epi64( _mm_mul_epu32( x, magic ), A85SHIFT );
+  odd = _mm_srli_epi64( _mm_mul_epu32( _mm_srli_epi64( x, 32 ), magic ), A85SHIFT );
+  return _mm_or_si128( even, _mm_slli_epi64( odd, 32 ) );
+}
+
+/* x - 85*q, using shifts as SSE2 has no 32-bit multiply (85 = 64+16+4+1) */
+static __m128i a85_rem85_sse2( __m128i x, __m128i q )
+{
+  __m128i t;
+  
+  t = _mm_add_epi32( _mm_add_epi32( _mm_slli_epi32( q, 6 ), _mm_slli_epi32( q, 4 ) ),
+    _mm_add_epi32( _mm_slli_epi32( q, 2 ), q ) );
+  return _mm_sub_epi32( x, t );
+}
+
+static void a85_kernel_sse2( const unsigned int *Words, unsigned int n,
+  unsigned int *Hi, unsigned char *Lo )
+{
+  const __m128i bang = _mm_set1_epi32( 0x21212121 );
+  __m128i v, q, d[5];
+  unsigned int ii, jj, lo[4];
+  
+  for( ii=0; ii+4<=n; ii+=4 )
+  {
+    v = _mm_loadu_si128( (const __m128i *)( Words+ii ) );
+    for( jj=4; jj>0; jj-- )
+    {
+      q = a85_div85_sse2( v );
+      d[jj] = a85_rem85_sse2( v, q );
+      v = q;
+    }
+    d[0] = v;
+    v = _mm_or_si128( _mm_or_si128( d[0], _mm_slli_epi32( d[1], 8 ) ),
+      _mm_or_si128( _mm_slli_epi32( d[2], 16 ), _mm_slli_epi32( d[3], 24 ) ) );
+    _mm_storeu_si128( (__m128i *)( Hi+ii ), _mm_add_epi32( v, bang ) );
+    _mm_storeu_si128( (__m128i *)lo, d[4] );
+    for( jj=0; jj<4; jj++ ) Lo[ii+jj] = (unsigned char)( lo[jj]+33 );
+  }
+  a85_kernel_scalar( Words+ii, n-ii, Hi+ii, Lo+ii );
+}
+#endif
+
+#ifdef HAVE_AVX2
+#ifdef __GNUC__
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+static AVX2_TARGET void a85_kernel_avx2( const unsigned int *Words, unsigned int n,
+  unsigned int *Hi, unsigned char *Lo )
+{
+  const __m256i magic = _mm256_set1_epi32( (int)A85MAGIC );
+  const __m256i base = _mm256_set1_epi32( 85 );
+  const __m256i bang = _mm256_set1_epi32( 0x21212121 );
+  __m256i v, q, even, odd, d[5];
+  unsigned int ii, jj, lo[8];
+  
+  for( ii=0; ii+8<=n; ii+=8 )
+  {
+    v = _mm256_loadu_si256( (const __m256i *)( Words+ii ) );
+    for( jj=4; jj>0; jj-- )
+    {
+      even = _mm256_srli_epi64( _mm256_mul_epu32( v, magic ), A85SHIFT );
+      odd = _mm256_srli_epi64( _mm256_mul_epu32( _mm256_srli_epi64( v, 32 ), magic ), A85SHIFT );
+      q = _mm256_or_si256( even, _mm256_slli_epi64( odd, 32 ) );
+      d[jj] = _mm256_sub_epi32( v, _mm256_mullo_epi32( q, base ) );
+      v = q;
+    }
+    d[0] = v;
+    v = _mm256_or_si256( _mm256_or_si256( d[0], _mm256_slli_epi32( d[1], 8 ) ),
+      _mm256_or_si256( _mm256_slli_epi32( d[2], 16 ), _mm256_slli_epi32( d[3], 24 ) ) );
+    _mm256_storeu_si256( (__m256i *)( Hi+ii ), _mm256_add_epi32( v, bang ) );
+    _mm256_storeu_si256( (__m256i *)lo, d[4] );
+    for( jj=0; jj<8; jj++ ) Lo[ii+jj] = (unsigned char)( lo[jj]+33 );
+  }
+  /* Avoid AVX to SSE transition penalties in the rest of the encoder. */
+  _mm256_zeroupper();
+  a85_kernel_scalar( Words+ii, n-ii, Hi+ii, Lo+ii );
+}
+
+/* Runtime check for AVX2 support (including OS support for the state). */
+static int a85_have_avx2( void )
+{
+#ifdef _MSC_VER
+  int r[4];
+  
+  __cpuid( r, 0 );
+  if( r[0] < 7 ) return 0;
+  __cpuid( r, 1 );
+  /* OSXSAVE and AVX */
+  if( ( r[2] & 0x18000000 ) != 0x18000000 ) return 0;
+  if( ( _xgetbv( 0 ) & 6 ) != 6 ) return 0;
+  __cpuidex( r, 7, 0 );
+  return ( r[1] >> 5 ) & 1;
+#else
+  return __builtin_cpu_supports( "avx2" );
+#endif
+}
+#endif
+
+#ifdef HAVE_NEON
+static void a85_kernel_neon( const unsigned int *Words, unsigned int n,
+  unsigned int *Hi, unsigned char *Lo )
+{
+  const uint32x2_t magic = vdup_n_u32( A85MAGIC );
+  uint32x4_t v, q, d[5];
+  unsigned int ii, jj, lo[4];
+  
+  for( ii=0; ii+4<=n; ii+=4 )
+  {
+    v = vld1q_u32( Words+ii );
+    for( jj=4; jj>0; jj-- )
+    {
+      q = vcombine_u32(
+        vmovn_u64( vshrq_n_u64( vmull_u32( vget_low_u32( v ), magic ), A85SHIFT ) ),
+        vmovn_u64( vshrq_n_u64( vmull_u32( vget_high_u32( v ), magic ), A85SHIFT ) ) );
+      d[jj] = vmlsq_n_u32( v, q, 85 );
+      v = q;
+    }
+    d[0] = v;
+    v = vorrq_u32( vorrq_u32( d[0], vshlq_n_u32( d[1], 8 ) ),
+      vorrq_u32( vshlq_n_u32( d[2], 16 ), vshlq_n_u32( d[3], 24 ) ) );
+    vst1q_u32( Hi+ii, vaddq_u32( v, vdupq_n_u32( 0x21212121u ) ) );
+    vst1q_u32( lo, d[4] );
+    for( jj=0; jj<4; jj++ ) Lo[ii+jj] = (unsigned char)( lo[jj]+33 );
+  }
+  a85_kernel_scalar( Words+ii, n-ii, Hi+ii, Lo+ii );
+}
+#endif
+
+/**
+ *  Pick the fastest ASCII85 kernel the processor supports. The choice is
+ *  made on the first call.
+ */
+static a85_kernel a85_select_kernel( void )
+{
+  static a85_kernel kernel = NULL;
+  
+  if( kernel != NULL ) return kernel;
+#if defined(HAVE_AVX2)
+  if( a85_have_avx2() ) kernel = a85_kernel_avx2;
+  else kernel = a85_kernel_sse2;
+#elif defined(HAVE_SSE2)
+  kernel = a85_kernel_sse2;
+#elif defined(HAVE_NEON)
+  kernel = a85_kernel_neon;
+#else
+  kernel = a85_kernel_scalar;
+#endif
+  return kernel;
+}
+
+/**
+ *  Private function to write a block of characters, inserting a newline
+ *  every OUTPUTWIDTH characters.
+ */
+static void asciiprv_write( const char *x, size_t n, IO_State *y )
+{
+  size_t chunk;
+  
+  while( n > 0 )
+  {
+    chunk = OUTPUTWIDTH - y->ColumnWidth;
+    if( chunk > n ) chunk = n;
+    io_write( x, chunk, y );
+    x += chunk;
+    n -= chunk;
+    y->ColumnWidth += chunk;
+    if( y->ColumnWidth == OUTPUTWIDTH )
+    {
+      io_putc( 10, y );
+      y->ColumnWidth = 0;
+    }
+  }
+}
+/**
+ *  Store the five digits of a word from the kernels, in order. The bytes
+ *  of Hi are taken by value, so this works whatever the byte order.
+ */
+static void a85_store( char *x, unsigned int Hi, unsigned char Lo )
+{
+  x[0] = (char)Hi;
+  x[1] = (char)( Hi >> 8 );
+  x[2] = (char)( Hi >> 16 );
+  x[3] = (char)( Hi >> 24 );
+  x[4] = (char)Lo;
+}
+
+/**
+ *  Encode and output the batch of 32-bit words in the IO_State (or just
+ *  output them, if writing binary).
+ */
+static void asciistreamout_flush( IO_State *y )
+{
+  unsigned int Hi[ A85BATCH ];
+  unsigned char Lo[ A85BATCH ];
+  char chars[ 5*A85BATCH ];
+  unsigned int ii;
+  size_t n = 0;
+  double t, io;
+  
+  if( y->NumWords == 0 ) return;
+  t = stats_start( y );
+  io = y->Stats != NULL ? y->Stats->IoSeconds : 0;
+  if( y->Binary )
+  {
+    /* Binary output is just the words, most significant byte first */
+    for( ii=0; ii<y->NumWords; ii++ )
+    {
+      chars[ 4*ii ] = (char)( y->Words[ii] >> 24 );
+      chars[ 4*ii+1 ] = (char)( y->Words[ii] >> 16 );
+      chars[ 4*ii+2 ] = (char)( y->Words[ii] >> 8 );
+      chars[ 4*ii+3 ] = (char)y->Words[ii];
+    }
+    io_write( chars, 4*y->NumWords, y );
+  }
+  else
+  {
+    a85_select_kernel()( y->Words, y->NumWords, Hi, Lo );
+    for( ii=0; ii<y->NumWords; ii++ )
+    {
+      /* Special case, 0 gets written out as z */
+      if( y->Words[ii] == 0 ) chars[ n++ ] = 'z';
+      else
+      {
+        a85_store( chars+n, Hi[ii], Lo[ii] );
+        n += 5;
+      }
+    }
+    asciiprv_write( chars, n, y );
+  }
+  y->NumWords = 0;
+  
+  /* Any output flushed to the file counts as IO */
+  if( y->Stats != NULL )
+    y->Stats->Ascii85Seconds += eps_clock() - t - ( y->Stats->IoSeconds - io );
+}
+
+/**
+ *  Takes a variable bit-length raw input stream, and formats it into
+ *  ASCII85 format. Complete 32-bit groups are collected, and encoded in
+ *  batches.
+ */
+static void asciistreamout( unsigned int x, IO_State *y, LZW_State *z )
+{
+  int shift;
+  
+  /* Shift the new data in. */
+  shift = (32-z->BitSize-y->StorageIndex);
+  if( shift >= 0 ) y->Storage |= (x<<shift);
+  else y->Storage |= (x>>-shift);
+  
+  y->StorageIndex += z->BitSize;
+  
+  /* If the buffer is full (i.e. 32-bits) queue it for output. */
+  if( y->StorageIndex >= 32 )
+  {
+    y->Words[ y->NumWords++ ] = y->Storage;
+    if( y->NumWords == A85BATCH ) asciistreamout_flush( y );
+    y->StorageIndex -= 32;
+    /* Add any left-over bits to the storage. */
+    if( y->StorageIndex == 0 ) y->Storage = 0;
+    else y->Storage = (x<<(32-y->StorageIndex));
+  }
+}
+
+/**
+ *  Cleanup the output stream. Outputs whatever partially completed bits
+ *  are present.
+ */
+static void asciistreamout_cleanup( IO_State *y )
+{
+  int numBytes;
+  unsigned int Hi;
+  unsigned char Lo;
+  char chars[5];
+  
+  asciistreamout_flush( y );
+  
+  /* Binary output just needs the remaining bits, padded to a byte */
+  if( y->Binary )
+  {
+    for( numBytes=0; numBytes*8<y->StorageIndex; numBytes++ )
+      chars[ numBytes ] = (char)( y->Storage >> ( 24-8*numBytes ) );
+    io_write( chars, numBytes, y );
+    y->StorageIndex = 0;
+    y->Storage = 0;
+    return;
+  }
+  
+  /* Only output as many bytes as required, as per Adobe ASCII85 */
+  numBytes = 5 - (32-y->StorageIndex)/8;
+  a85_kernel_scalar( &y->Storage, 1, &Hi, &Lo );
+  a85_store( chars, Hi, Lo );
+  asciiprv_write( chars, numBytes, y );
+    
+  /* Cleanup variables, output the 'end of data' string. */
+  y->StorageIndex = 0;
+  y->Storage = 0;
+  y->ColumnWidth = 0;
+  io_puts( "~>", y );
+}
+
+/**
+ *  Update the Dictionary with new values, and outputs the current prefix.
+ *  Slot is the empty hash table entry found by LZW(), or NULL if the
+ *  prefix is being flushed at the end of the data and nothing needs to be
+ *  stored.
+ */
+static void NotInDictionary( LZW_Entry *Slot, IO_State *y, LZW_State *z )
+{
+  unsigned long long ratio;
+  int temp;
+  
+  /* Update the table */
+  if( Slot != NULL )
+  {
+    Slot->Key = ( (unsigned int)z->CurrentIndex << 8 ) | z->CurrentChar;
+    Slot->Code = (unsigned short)z->NextIndex;
+    Slot->Epoch = z->Epoch;
+  }
+  z->NextIndex++;
+
+  /* Output the current index (prefix) */
+  asciistreamout( z->CurrentIndex, y, z );
+  z->OutBits += z->BitSize;
+  /* Update to the new index (prefix) */
+  z->CurrentIndex = z->CurrentChar;
+  
+  /* Check to see if bitsize has been exceeded. A full table must always
+     be cleared, as LZWDecode doesn't carry on with one. */
+  if( z->NextIndex == z->MaxIndex )
+  {
+    if( z->BitSize == BITMAX )
+    {
+      asciistreamout( CLEARTABLE, y, z );
+      z->Resets++;
+      temp = z->CurrentIndex;
+      LZW_State_Init( z );
+      z->CurrentIndex = temp;
+    }
+    else
+    {
+      z->BitSize++;
+      z->MaxIndex = (1<<z->BitSize);
+      z->CheckIn = z->InCount;
+      z->CheckBits = z->OutBits;
+    }
+    return;
+  }
+  
+  /* With the adaptive reset, every CHECKGAP characters once the codes
+     are BITMAX bits wide, compare the ratio over them with the ratio since
+     the table was cleared. If the latest input does worse, the table has
+     gone stale, so clear it without waiting for it to fill. */
+  if( !z->Adaptive || Slot == NULL || z->BitSize != BITMAX ||
+      z->InCount - z->CheckIn < CHECKGAP ) return;
+  ratio = ( ( z->InCount - z->CheckIn ) << 11 ) / ( z->OutBits - z->CheckBits );
+  z->CheckIn = z->InCount;
+  z->CheckBits = z->OutBits;
+  if( ratio >= ( z->InCount << 11 ) / z->OutBits ) return;
+  asciistreamout( CLEARTABLE, y, z );
+  z->Resets++;
+  temp = z->CurrentIndex;
+  LZW_State_Init( z );
+  z->CurrentIndex = temp;
+}
+
+/**
+ *  LZW Compression function.
+ */
+static void LZW( unsigned char x, IO_State *y, LZW_State *z)
+{
+  unsigned int Key, h;
+
+  z->InCount++;
+  if( z->CurrentIndex == -1 )
+  {
+    z->CurrentIndex = x;
+    return;
+  }
+  
+  z->CurrentChar = x;
+  z->Lookups++;
+    
+  /* Linear probe for the (prefix,character) pair. */
+  Key = ( (unsigned int)z->CurrentIndex << 8 ) | x;
+  h = LZW_HASH( Key ) & HASHMASK;
+  while( z->Table[ h ].Epoch == z->Epoch )
+  {
+    /* If we find a value in the dictionary */
+    if( z->Table[ h ].Key == Key )
+    {
+      z->CurrentIndex = z->Table[ h ].Code;
+      return;
+    }
+    h = ( h+1 ) & HASHMASK;
+    z->Probes++;
+  }
+  NotInDictionary( &z->Table[ h ], y, z );
+}
+
+/* Force the width specialised LZW loops to be inlined, so that each one
+   is compiled with its width as a constant */
+#if defined(__GNUC__)
+#define LZW_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define LZW_INLINE static __forceinline
+#else
+#define LZW_INLINE static
+#endif
+
+/**
+ *  LZW compress up to n characters while the codes are Width bits wide.
+ *  With Width a constant, the codes are packed into 32-bit words with a
+ *  fixed shift, and the next width boundary is a fixed index. The loop
+ *  runs until the input ends, or a new table entry reaches the boundary;
+ *  that entry is left to NotInDictionary, which widens the codes (or
+ *  clears the table). Returns the number of characters compressed. There
+ *  must be a current prefix.
+ */
+LZW_INLINE size_t lzw_block( const unsigned char *x, size_t n, IO_State *y, LZW_State *z,
+  const unsigned int Width )
+{
+  LZW_Entry *table = z->Table;
+  const unsigned short epoch = z->Epoch;
+  unsigned long long bits = y->StorageIndex ? y->Storage >> ( 32 - y->StorageIndex ) : 0;
+  unsigned long long probes = 0, codes = 0;
+  unsigned int count = (unsigned int)y->StorageIndex, prefix = (unsigned int)z->CurrentIndex;
+  unsigned int next = z->NextIndex, key, h = 0;
+  size_t ii;
+  
+  for( ii=0; ii<n; ii++ )
+  {
+    key = ( prefix << 8 ) | x[ii];
+    h = LZW_HASH( key ) & HASHMASK;
+    while( table[h].Epoch == epoch && table[h].Key != key )
+    {
+      h = ( h+1 ) & HASHMASK;
+      probes++;
+    }
+    if( table[h].Epoch == epoch )
+    {
+      prefix = table[h].Code;
+      continue;
+    }
+    if( next+1 == ( 1u << Width ) ) break;
+    table[h].Key = key;
+    table[h].Code = (unsigned short)next++;
+    table[h].Epoch = epoch;
+    
+    /* Output the prefix, queueing each 32-bit word as it fills */
+    bits = ( bits << Width ) | prefix;
+    count += Width;
+    codes++;
+    if( count >= 32 )
+    {
+      count -= 32;
+      y->Words[ y->NumWords++ ] = (unsigned int)( bits >> count );
+      if( y->NumWords == A85BATCH ) asciistreamout_flush( y );
+    }
+    prefix = x[ii];
+  }
+  
+  y->Storage = count ? (unsigned int)( bits << ( 32 - count ) ) : 0;
+  y->StorageIndex = (int)count;
+  z->CurrentIndex = (int)prefix;
+  z->NextIndex = next;
+  z->InCount += ii;
+  z->Lookups += ii;
+  z->Probes += probes;
+  z->OutBits += codes*Width;
+  if( ii == n ) return n;
+  
+  /* The entry that reaches the boundary */
+  z->InCount++;
+  z->Lookups++;
+  z->CurrentChar = x[ii];
+  NotInDictionary( &table[h], y, z );
+  return ii+1;
+}
+
+#define LZW_BLOCK( Width ) \
+  static size_t lzw_block_##Width( const unsigned char *x, size_t n, IO_State *y, LZW_State *z ) \
+  { \
+    return lzw_block( x, n, y, z, Width ); \
+  }
+LZW_BLOCK( 9 )
+LZW_BLOCK( 10 )
+LZW_BLOCK( 11 )
+LZW_BLOCK( 12 )
+
+/**
+ *  LZW compress a block of input, handing over from the loop for each
+ *  code width to the next as the table grows. The first character goes
+ *  through LZW(). With the adaptive reset, the BITMAX bit loop stops every
+ *  CHECKGAP characters, and the input then goes through LZW() until the
+ *  next new entry, where NotInDictionary checks the ratio.
+ */
+static void LZW_Block( const char *x, size_t n, IO_State *y, LZW_State *z )
+{
+  const unsigned char *c = (const unsigned char *)x;
+  unsigned long long check;
+  size_t k;
+  
+  while( n > 0 )
+  {
+    if( z->CurrentIndex == -1 )
+    {
+      LZW( *c, y, z );
+      k = 1;
+    }
+    else if( z->Adaptive && z->BitSize == BITMAX )
+    {
+      check = z->CheckIn;
+      if( z->InCount - check >= CHECKGAP )
+        for( k=0; k<n && z->CheckIn == check && z->BitSize == BITMAX; k++ ) LZW( c[k], y, z );
+      else
+      {
+        k = CHECKGAP - (size_t)( z->InCount - check );
+        k = lzw_block_12( c, k < n ? k : n, y, z );
+      }
+    }
+    else switch( z->BitSize )
+    {
+      case 9: k = lzw_block_9( c, n, y, z ); break;
+      case 10: k = lzw_block_10( c, n, y, z ); break;
+      case 11: k = lzw_block_11( c, n, y, z ); break;
+      default: k = lzw_block_12( c, n, y, z ); break;
+    }
+    c += k;
+    n -= k;
+  }
+}
+
+/**
+ *  Queue a single byte for ASCII85 output. Only used while the storage
+ *  is byte aligned, as it always is for Flate output.
+ */
+static void asciistreamout_byte( unsigned char x, IO_State *y )
+{
+  y->Storage |= (unsigned int)x << ( 24 - y->StorageIndex );
+  y->StorageIndex += 8;
+  if( y->StorageIndex == 32 )
+  {
+    y->Words[ y->NumWords++ ] = y->Storage;
+    if( y->NumWords == A85BATCH ) asciistreamout_flush( y );
+    y->StorageIndex = 0;
+    y->Storage = 0;
+  }
+}
+
+/**
+ *  Floor of log2, for x > 0.
+ */
+static unsigned int flate_log2( unsigned int x )
+{
+#if defined(__GNUC__)
+  return 31 - __builtin_clz( x );
+#elif defined(_MSC_VER)
+  unsigned long r;
+  
+  _BitScanReverse( &r, x );
+  return (unsigned int)r;
+#else
+  unsigned int r = 0;
+  
+  while( x >>= 1 ) r++;
+  return r;
+#endif
+}
+
+/**
+ *  Deflate length code (0-28, i.e. symbol 257-285) of a match length-3,
+ *  and the number of extra bits it takes.
+ */
+static unsigned int flate_length_code( unsigned int x, unsigned int *Extra )
+{
+  unsigned int e;
+  
+  if( x < 8 ) { *Extra = 0; return x; }
+  if( x == 255 ) { *Extra = 0; return 28; }
+  e = flate_log2( x ) - 2;
+  *Extra = e;
+  return 4*e + ( x >> e );
+}
+
+/**
+ *  Deflate distance code (0-29) of a match distance-1, and the number of
+ *  extra bits it takes.
+ */
+static unsigned int flate_distance_code( unsigned int x, unsigned int *Extra )
+{
+  unsigned int e;
+  
+  if( x < 4 ) { *Extra = 0; return x; }
+  e = flate_log2( x ) - 1;
+  *Extra = e;
+  return 2*e + ( x >> e );
+}
+
+/**
+ *  Compute Huffman code lengths of at most MaxBits for n symbols. If the
+ *  lengths come out too long, the frequencies are flattened and the tree
+ *  is built again.
+ */
+static void flate_huffman_lengths( const unsigned int *Freq, int n, int MaxBits,
+  unsigned char *Lengths )
+{
+  unsigned int w[ 288 ], weight[ 2*288 ];
+  int sym[ 288 ], parent[ 2*288 ], depth[ 2*288 ];
+  int m, ii, jj, kk, t, leaf, node, next, maxDepth;
+  
+  for( ii=0; ii<n; ii++ ) w[ii] = Freq[ii];
+  for(;;)
+  {
+    memset( Lengths, 0, n );
+    m = 0;
+    for( ii=0; ii<n; ii++ ) if( w[ii] ) sym[ m++ ] = ii;
+    if( m == 0 ) return;
+    if( m == 1 )
+    {
+      Lengths[ sym[0] ] = 1;
+      return;
+    }
+    
+    /* Sort the used symbols by frequency */
+    for( ii=1; ii<m; ii++ )
+    {
+      t = sym[ii];
+      for( jj=ii; jj>0 && w[ sym[jj-1] ] > w[t]; jj-- ) sym[jj] = sym[jj-1];
+      sym[jj] = t;
+    }
+    for( ii=0; ii<m; ii++ ) weight[ii] = w[ sym[ii] ];
+    
+    /* Build the tree with two queues: the sorted leaves, and the internal
+       nodes, which are created in order of weight. */
+    leaf = 0;
+    node = m;
+    for( next=m; next<2*m-1; next++ )
+    {
+      weight[ next ] = 0;
+      for( kk=0; kk<2; kk++ )
+      {
+        if( leaf < m && ( node == next || weight[ leaf ] <= weight[ node ] ) ) t = leaf++;
+        else t = node++;
+        parent[t] = next;
+        weight[ next ] += weight[t];
+      }
+    }
+    depth[ 2*m-2 ] = 0;
+    maxDepth = 0;
+    for( ii=2*m-3; ii>=0; ii-- )
+    {
+      depth[ii] = depth[ parent[ii] ] + 1;
+      if( ii < m && depth[ii] > maxDepth ) maxDepth = depth[ii];
+    }
+    if( maxDepth <= MaxBits )
+    {
+      for( ii=0; ii<m; ii++ ) Lengths[ sym[ii] ] = (unsigned char)depth[ii];
+      return;
+    }
+    for( ii=0; ii<n; ii++ ) if( w[ii] ) w[ii] = ( w[ii] >> 1 ) | 1;
+  }
+}
+
+/**
+ *  Compute the canonical Huffman codes for a set of code lengths. The
+ *  codes are bit reversed, as they are written least significant bit
+ *  first.
+ */
+static void flate_huffman_codes( const unsigned char *Lengths, int n, unsigned int *Codes )
+{
+  unsigned int count[ 16 ], next[ 16 ], code = 0, c, r;
+  int ii, jj;
+  
+  memset( count, 0, sizeof( count ) );
+  for( ii=0; ii<n; ii++ ) count[ Lengths[ii] ]++;
+  count[0] = 0;
+  for( ii=1; ii<16; ii++ )
+  {
+    code = ( code + count[ii-1] ) << 1;
+    next[ii] = code;
+  }
+  for( ii=0; ii<n; ii++ )
+  {
+    if( Lengths[ii] == 0 ) continue;
+    c = next[ Lengths[ii] ]++;
+    r = 0;
+    for( jj=0; jj<Lengths[ii]; jj++ )
+    {
+      r = ( r << 1 ) | ( c & 1 );
+      c >>= 1;
+    }
+    Codes[ii] = r;
+  }
+}
+
+/**
+ *  Initialise Flate_State data structure.
+ */
+static void Flate_State_Init( Flate_State *f )
+{
+  int ii;
+  
+  memset( f->Head, 0, sizeof( f->Head ) );
+  f->Position = 0;
+  f->End = 0;
+  f->MatchLength = FLATEMINMATCH-1;
+  f->MatchStart = 0;
+  f->PrevLength = FLATEMINMATCH-1;
+  f->PrevMatch = 0;
+  f->MatchAvailable = 0;
+  f->Adler1 = 1;
+  f->Adler2 = 0;
+  f->NumSymbols = 0;
+  memset( f->LitFreq, 0, sizeof( f->LitFreq ) );
+  memset( f->DistFreq, 0, sizeof( f->DistFreq ) );
+  f->BitBuffer = 0;
+  f->BitCount = 0;
+  for( ii=0; ii<288; ii++ )
+    f->FixedLengths[ii] = ii < 144 ? 8 : ii < 256 ? 9 : ii < 280 ? 7 : 8;
+  flate_huffman_codes( f->FixedLengths, 288, f->FixedCodes );
+}
+
+/**
+ *  Write n (at most 16) bits to the output.
+ */
+static void flate_putbits( unsigned int x, unsigned int n, Flate_State *f, IO_State *y )
+{
+  f->BitBuffer |= (unsigned long long)x << f->BitCount;
+  f->BitCount += n;
+  while( f->BitCount >= 8 )
+  {
+    asciistreamout_byte( (unsigned char)f->BitBuffer, y );
+    f->BitBuffer >>= 8;
+    f->BitCount -= 8;
+  }
+}
+
+/**
+ *  Number of bits the symbols of the block take with the given codes.
+ */
+static unsigned long flate_block_cost( Flate_State *f, const unsigned char *LitLengths,
+  const unsigned char *DistLengths )
+{
+  unsigned long cost = 0;
+  unsigned int ii;
+  
+  for( ii=0; ii<286; ii++ )
+  {
+    cost += f->LitFreq[ii] * LitLengths[ii];
+    /* Extra bits of the length codes 265-284 */
+    if( ii >= 265 && ii < 285 ) cost += f->LitFreq[ii] * ( ( ii-261 ) / 4 );
+  }
+  for( ii=0; ii<30; ii++ )
+  {
+    cost += f->DistFreq[ii] * DistLengths[ii];
+    if( ii >= 4 ) cost += f->DistFreq[ii] * ( ( ii-2 ) / 2 );
+  }
+  return cost;
+}
+
+/**
+ *  Write out a block containing the collected symbols, using whichever
+ *  of the fixed or a dynamic Huffman code is smaller.
+ */
+static void flate_block( Flate_State *f, int Last, IO_State *y )
+{
+  static const unsigned char order[ 19 ] =
+    { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+  unsigned char litLengths[ 288 ], distLengths[ 32 ], fixedDist[ 32 ];
+  unsigned char lengths[ 288+32 ], rle[ 288+32 ], rleExtra[ 288+32 ], clLengths[ 19 ];
+  unsigned int litCodes[ 288 ], distCodes[ 32 ], clCodes[ 19 ], clFreq[ 19 ];
+  unsigned int hlit, hdist, hclen, total, numRle, run, r, ii, code, extra, len, dist;
+  unsigned long dynamicCost, fixedCost;
+  unsigned int *lc, *dc;
+  unsigned char *ll, *dl;
+  
+  f->LitFreq[ 256 ] = 1;
+  flate_huffman_lengths( f->LitFreq, 286, 15, litLengths );
+  flate_huffman_lengths( f->DistFreq, 30, 15, distLengths );
+  /* At least one distance code has to be sent */
+  for( ii=0; ii<30 && distLengths[ii] == 0; ii++ );
+  if( ii == 30 ) distLengths[0] = 1;
+  litLengths[ 286 ] = litLengths[ 287 ] = 0;
+  distLengths[ 30 ] = distLengths[ 31 ] = 0;
+  
+  for( hlit=286; hlit>257 && litLengths[ hlit-1 ] == 0; hlit-- );
+  for( hdist=30; hdist>1 && distLengths[ hdist-1 ] == 0; hdist-- );
+  memcpy( lengths, litLengths, hlit );
+  memcpy( lengths+hlit, distLengths, hdist );
+  total = hlit + hdist;
+  
+  /* Run length encode the code lengths */
+  numRle = 0;
+  memset( clFreq, 0, sizeof( clFreq ) );
+  for( ii=0; ii<total; ii+=run )
+  {
+    for( run=1; ii+run<total && lengths[ ii+run ] == lengths[ii]; run++ );
+    if( lengths[ii] == 0 && run >= 3 )
+    {
+      r = run > 138 ? 138 : run;
+      rle[ numRle ] = r >= 11 ? 18 : 17;
+      rleExtra[ numRle++ ] = (unsigned char)( r >= 11 ? r-11 : r-3 );
+      run = r;
+    }
+    else if( lengths[ii] != 0 && run >= 4 )
+    {
+      /* The first length is sent as-is, the rest as repeats */
+      r = run-1 > 6 ? 6 : run-1;
+      rle[ numRle ] = lengths[ii];
+      rleExtra[ numRle++ ] = 0;
+      rle[ numRle ] = 16;
+      rleExtra[ numRle++ ] = (unsigned char)( r-3 );
+      run = r+1;
+    }
+    else
+    {
+      rle[ numRle ] = lengths[ii];
+      rleExtra[ numRle++ ] = 0;
+      run = 1;
+    }
+  }
+  for( ii=0; ii<numRle; ii++ ) clFreq[ rle[ii] ]++;
+  flate_huffman_lengths( clFreq, 19, 7, clLengths );
+  for( hclen=19; hclen>4 && clLengths[ order[ hclen-1 ] ] == 0; hclen-- );
+  
+  /* Compare the sizes of the dynamic and fixed blocks */
+  dynamicCost = 14 + 3*hclen + flate_block_cost( f, litLengths, distLengths );
+  for( ii=0; ii<19; ii++ )
+  {
+    dynamicCost += clFreq[ii] * clLengths[ii];
+    if( ii >= 16 ) dynamicCost += clFreq[ii] * ( ii == 16 ? 2 : ii == 17 ? 3 : 7 );
+  }
+  memset( fixedDist, 5, sizeof( fixedDist ) );
+  fixedCost = flate_block_cost( f, f->FixedLengths, fixedDist );
+  
+  flate_putbits( Last ? 1 : 0, 1, f, y );
+  if( fixedCost <= dynamicCost )
+  {
+    flate_putbits( 1, 2, f, y );
+    for( ii=0; ii<32; ii++ )
+    {
+      r = 0;
+      for( code=ii, len=0; len<5; len++, code>>=1 ) r = ( r << 1 ) | ( code & 1 );
+      distCodes[ii] = r;
+    }
+    lc = f->FixedCodes;
+    ll = f->FixedLengths;
+    dc = distCodes;
+    dl = fixedDist;
+  }
+  else
+  {
+    flate_putbits( 2, 2, f, y );
+    flate_huffman_codes( litLengths, 288, litCodes );
+    flate_huffman_codes( distLengths, 32, distCodes );
+    flate_huffman_codes( clLengths, 19, clCodes );
+    flate_putbits( hlit-257, 5, f, y );
+    flate_putbits( hdist-1, 5, f, y );
+    flate_putbits( hclen-4, 4, f, y );
+    for( ii=0; ii<hclen; ii++ ) flate_putbits( clLengths[ order[ii] ], 3, f, y );
+    for( ii=0; ii<numRle; ii++ )
+    {
+      flate_putbits( clCodes[ rle[ii] ], clLengths[ rle[ii] ], f, y );
+      if( rle[ii] == 16 ) flate_putbits( rleExtra[ii], 2, f, y );
+      else if( rle[ii] == 17 ) flate_putbits( rleExtra[ii], 3, f, y );
+      else if( rle[ii] == 18 ) flate_putbits( rleExtra[ii], 7, f, y );
+    }
+    lc = litCodes;
+    ll = litLengths;
+    dc = distCodes;
+    dl = distLengths;
+  }
+  
+  /* Write the symbols, then the end of block */
+  for( ii=0; ii<f->NumSymbols; ii++ )
+  {
+    dist = f->SymDistance[ii];
+    if( dist == 0 )
+    {
+      flate_putbits( lc[ f->SymLength[ii] ], ll[ f->SymLength[ii] ], f, y );
+      continue;
+    }
+    len = f->SymLength[ii];
+    code = 257 + flate_length_code( len, &extra );
+    flate_putbits( lc[ code ], ll[ code ], f, y );
+    if( extra ) flate_putbits( len & ( (1u<<extra)-1 ), extra, f, y );
+    code = flate_distance_code( dist-1, &extra );
+    flate_putbits( dc[ code ], dl[ code ], f, y );
+    if( extra ) flate_putbits( ( dist-1 ) & ( (1u<<extra)-1 ), extra, f, y );
+  }
+  flate_putbits( lc[ 256 ], ll[ 256 ], f, y );
+  
+  f->NumSymbols = 0;
+  memset( f->LitFreq, 0, sizeof( f->LitFreq ) );
+  memset( f->DistFreq, 0, sizeof( f->DistFreq ) );
+}
+
+/**
+ *  Add a literal or a match to the current block, writing the block out
+ *  once it is full.
+ */
+static void flate_literal( unsigned char x, Flate_State *f, IO_State *y )
+{
+  f->SymLength[ f->NumSymbols ] = x;
+  f->SymDistance[ f->NumSymbols++ ] = 0;
+  f->LitFreq[x]++;
+  if( f->NumSymbols == FLATESYMBOLS ) flate_block( f, 0, y );
+}
+
+static void flate_match( unsigned int Length, unsigned int Distance, Flate_State *f, IO_State *y )
+{
+  unsigned int extra;
+  
+  f->SymLength[ f->NumSymbols ] = (unsigned char)( Length-FLATEMINMATCH );
+  f->SymDistance[ f->NumSymbols++ ] = (unsigned short)Distance;
+  f->LitFreq[ 257 + flate_length_code( Length-FLATEMINMATCH, &extra ) ]++;
+  f->DistFreq[ flate_distance_code( Distance-1, &extra ) ]++;
+  if( f->NumSymbols == FLATESYMBOLS ) flate_block( f, 0, y );
+}
+
+/**
+ *  Insert the string at position p into the hash chains, returning the
+ *  previous head of its chain.
+ */
+static unsigned int flate_insert( Flate_State *f, unsigned int p )
+{
+  unsigned int h, head;
+  
+  h = ( ( f->Window[p] | ( f->Window[p+1] << 8 ) | ( f->Window[p+2] << 16 ) )
+    * 2654435761u ) >> 17;
+  head = f->Head[h];
+  f->Prev[ p & (FLATEWINDOW-1) ] = (unsigned short)head;
+  f->Head[h] = (unsigned short)p;
+  return head;
+}
+
+/**
+ *  Length of the common prefix of a and b, up to maxLength. The first two
+ *  bytes are already known to match. Compares eight bytes at a time where
+ *  it can.
+ */
+static unsigned int flate_compare( const unsigned char *a, const unsigned char *b,
+  unsigned int maxLength )
+{
+  unsigned long long x, y;
+  unsigned int len = 2;
+  
+  while( len+8 <= maxLength )
+  {
+    memcpy( &x, a+len, 8 );
+    memcpy( &y, b+len, 8 );
+    if( x != y )
+    {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return len + ( __builtin_ctzll( x ^ y ) >> 3 );
+#else
+      break;
+#endif
+    }
+    len += 8;
+  }
+  while( len < maxLength && a[len] == b[len] ) len++;
+  return len;
+}
+
+/**
+ *  Find the longest match for the current position along the hash chain
+ *  starting at Match. Returns the length (which is no longer than
+ *  PrevLength if nothing better was found), and sets MatchStart.
+ */
+static unsigned int flate_longest_match( Flate_State *f, unsigned int Match )
+{
+  const unsigned char *w = f->Window, *cur = f->Window + f->Position, *m;
+  unsigned int chain = FLATECHAIN, best = f->PrevLength, maxLength, limit, len;
+  
+  maxLength = f->End - f->Position;
+  if( maxLength > FLATEMAXMATCH ) maxLength = FLATEMAXMATCH;
+  if( best >= maxLength ) return best;
+  limit = f->Position > FLATEMAXDIST ? f->Position - FLATEMAXDIST : 0;
+  if( f->PrevLength >= FLATEGOOD ) chain >>= 2;
+  
+  while( Match > limit && chain-- != 0 )
+  {
+    m = w + Match;
+    if( m[ best ] == cur[ best ] && m[0] == cur[0] && m[1] == cur[1] )
+    {
+      len = flate_compare( m, cur, maxLength );
+      if( len > best )
+      {
+        best = len;
+        f->MatchStart = Match;
+        if( len >= FLATENICE || len >= maxLength ) break;
+      }
+    }
+    Match = f->Prev[ Match & (FLATEWINDOW-1) ];
+  }
+  return best;
+}
+
+/**
+ *  Run the lazy matcher over the input in the window. Unless flushing,
+ *  it stops once there isn't enough look-ahead to find a full match.
+ */
+static void flate_process( Flate_State *f, int Flush, IO_State *y )
+{
+  unsigned int head, lookahead, last, p;
+  
+  for(;;)
+  {
+    lookahead = f->End - f->Position;
+    if( lookahead == 0 || ( lookahead < FLATELOOKAHEAD && !Flush ) ) break;
+    
+    head = lookahead >= FLATEMINMATCH ? flate_insert( f, f->Position ) : 0;
+    f->PrevLength = f->MatchLength;
+    f->PrevMatch = f->MatchStart;
+    f->MatchLength = FLATEMINMATCH-1;
+    if( head != 0 && f->PrevLength < FLATELAZY )
+    {
+      f->MatchLength = flate_longest_match( f, head );
+      /* Short matches a long way back aren't worth it */
+      if( f->MatchLength == FLATEMINMATCH && f->Position - f->MatchStart > 4096 )
+        f->MatchLength = FLATEMINMATCH-1;
+    }
+    
+    /* If the previous match is at least as good, use it */
+    if( f->PrevLength >= FLATEMINMATCH && f->MatchLength <= f->PrevLength )
+    {
+      flate_match( f->PrevLength, f->Position-1 - f->PrevMatch, f, y );
+      last = f->Position-1 + f->PrevLength;
+      for( p=f->Position+1; p<last; p++ )
+        if( p+FLATEMINMATCH <= f->End ) flate_insert( f, p );
+      f->Position = last;
+      f->MatchAvailable = 0;
+      f->MatchLength = FLATEMINMATCH-1;
+    }
+    else if( f->MatchAvailable )
+    {
+      flate_literal( f->Window[ f->Position-1 ], f, y );
+      f->Position++;
+    }
+    else
+    {
+      f->MatchAvailable = 1;
+      f->Position++;
+    }
+  }
+  if( Flush && f->MatchAvailable )
+  {
+    flate_literal( f->Window[ f->Position-1 ], f, y );
+    f->MatchAvailable = 0;
+  }
+}
+
+/**
+ *  Slide the window down by FLATEWINDOW, dropping the positions that
+ *  fall out of it.
+ */
+static void flate_slide( Flate_State *f )
+{
+  unsigned int ii;
+  
+  memmove( f->Window, f->Window + FLATEWINDOW, FLATEWINDOW );
+  f->Position -= FLATEWINDOW;
+  f->End -= FLATEWINDOW;
+  f->MatchStart = f->MatchStart >= FLATEWINDOW ? f->MatchStart - FLATEWINDOW : 0;
+  f->PrevMatch = f->PrevMatch >= FLATEWINDOW ? f->PrevMatch - FLATEWINDOW : 0;
+  for( ii=0; ii<FLATEHASHSIZE; ii++ )
+    f->Head[ii] = f->Head[ii] >= FLATEWINDOW ? f->Head[ii] - FLATEWINDOW : 0;
+  for( ii=0; ii<FLATEWINDOW; ii++ )
+    f->Prev[ii] = f->Prev[ii] >= FLATEWINDOW ? f->Prev[ii] - FLATEWINDOW : 0;
+}
+
+/**
+ *  Start a Flate stream, with the zlib header.
+ */
+static void Flate_Begin( Flate_State *f, IO_State *y )
+{
+  Flate_State_Init( f );
+  /* Deflate with a 32K window, default compression level */
+  asciistreamout_byte( 0x78, y );
+  asciistreamout_byte( 0x9c, y );
+}
+
+/**
+ *  Flate compression function, taking a block of input.
+ */
+static void Flate( const char *x, size_t n, Flate_State *f, IO_State *y )
+{
+  const unsigned char *c = (const unsigned char *)x;
+  size_t ii, k;
+  
+  /* Update the Adler-32 checksum, taking the modulus before it can
+     overflow */
+  while( n > 0 )
+  {
+    if( f->End == 2*FLATEWINDOW ) flate_slide( f );
+    k = 2*FLATEWINDOW - f->End;
+    if( k > n ) k = n;
+    if( k > 5552 ) k = 5552;
+    for( ii=0; ii<k; ii++ )
+    {
+      f->Adler1 += c[ii];
+      f->Adler2 += f->Adler1;
+    }
+    f->Adler1 %= 65521;
+    f->Adler2 %= 65521;
+    memcpy( f->Window + f->End, c, k );
+    f->End += k;
+    c += k;
+    n -= k;
+    flate_process( f, 0, y );
+  }
+}
+
+/**
+ *  Finish a Flate stream: flush the input, write the last block and the
+ *  Adler-32 checksum.
+ */
+static void Flate_End( Flate_State *f, IO_State *y )
+{
+  unsigned int adler;
+  
+  flate_process( f, 1, y );
+  flate_block( f, 1, y );
+  if( f->BitCount > 0 ) flate_putbits( 0, 8 - f->BitCount, f, y );
+  adler = ( f->Adler2 << 16 ) | f->Adler1;
+  asciistreamout_byte( (unsigned char)( adler >> 24 ), y );
+  asciistreamout_byte( (unsigned char)( adler >> 16 ), y );
+  asciistreamout_byte( (unsigned char)( adler >> 8 ), y );
+  asciistreamout_byte( (unsigned char)adler, y );
+}
+
+/**
+ *  Return the status of the output so far.
+ */
+static int io_status( IO_State *y )
+{
+  if( y->ReadError ) return EPS_READ_ERROR;
+  if( y->OutOfMemory ) return EPS_OUT_OF_MEMORY;
+  if( y->WriteError ) return EPS_WRITE_ERROR;
+  return EPS_OK;
+}
+
+/**
+ *  Error message for a non-zero return value of eps_compress (or failure
+ *  to open one of the files).
+ */
+const char *EpsErrorMessage( int status )
+{
+  switch( status )
+  {
+    case EPS_NOT_EPS: return "Input file is not an EPS file.";
+    case EPS_OUT_OF_MEMORY: return "Out of memory.";
+    case EPS_WRITE_ERROR: return "Error writing to the output file.";
+    case EPS_CANT_READ: return "Cannot open the input file for reading.";
+    case EPS_CANT_WRITE: return "Cannot open the output file for writing.";
+    case EPS_READ_ERROR: return "Error reading the input file.";
+  }
+  return "";
+}
+
+void EPS_Options_Init( EPS_Options *o )
+{
+  o->Threads = 1;
+  o->Method = EPS_LZW;
+  o->Ascii85 = 1;
+  o->AdaptiveReset = 0;
+  o->Images = 0;
+  o->Downsample = 1;
+  memset( o->Pad, 0, sizeof( o->Pad ) );
+}
+
+/**
+ *  The (large) compression states, allocated when first needed and
+ *  reused between segments and files.
+ */
+struct EPS_Workspace{
+  LZW_State *z;
+  Flate_State *f;
+};
+
+/**
+ *  Allocate the state needed by a compression method, if it hasn't been
+ *  already. Returns 0 on success.
+ */
+static int EPS_Workspace_Prepare( EPS_Workspace *w, int Method )
+{
+  if( Method == EPS_FLATE )
+  {
+    if( w->f == NULL ) w->f = (Flate_State *)malloc( sizeof( Flate_State ) );
+    return w->f == NULL;
+  }
+  if( w->z == NULL ) w->z = (LZW_State *)calloc( 1, sizeof( LZW_State ) );
+  return w->z == NULL;
+}
+
+static void EPS_Workspace_Free( EPS_Workspace *w )
+{
+  free( w->z );
+  free( w->f );
+  w->z = NULL;
+  w->f = NULL;
+}
+
+/**
+ *  An image found in the input, with its hex encoded samples decoded.
+ *  Only 8 bits per component images read with readhexstring, from a
+ *  single source, are re-encoded.
+ */
+typedef struct{
+  unsigned long Width;
+  unsigned long Height;
+  int Colors;
+  /* The image header, up to and including its operator, and the matrix
+     operand within it */
+  char Header[ IMAGEHEADER ];
+  size_t HeaderLength;
+  char Matrix[ IMAGEHEADER ];
+  unsigned char *Samples;
+  size_t NumSamples;
+} EPS_Image;
+
+/**
+ *  A piece of the output: either a range of the input that is copied
+ *  as-is, a range of the input that is compressed into its own LZW
+ *  stream, or an image that is re-encoded.
+ */
+typedef struct{
+  int Compressed;
+  size_t Start;
+  size_t Length;
+  /* The image that replaces the range of the input, if any */
+  EPS_Image *Image;
+  /* Set if a newline follows the end of the compressed stream */
+  int Newline;
+  /* Compressed output and its status, filled in by the workers. For a
+     copied piece, replacement text for its range of the input. */
+  char *Output;
+  size_t OutputLength;
+  int Status;
+  /* Statistics of compressing the piece, if they are being gathered */
+  EPS_Stats Stats;
+} EPS_Piece;
+
+/**
+ *  List of the pieces found by scanning the input, for compressing them in
+ *  parallel. Also holds enough of the PostScript syntax state to find safe
+ *  places to split long segments: each piece is run by a seperate filter,
+ *  so a split can only be made at the start of a line outside of any
+ *  procedure, string or comment, and not at all once the segment uses
+ *  currentfile (e.g. to read image data).
+ */
+typedef struct{
+  const char *Input;
+  const EPS_Options *Options;
+  int Stats;
+  EPS_Piece *Pieces;
+  size_t NumPieces;
+  size_t Capacity;
+  int OutOfMemory;
+  int BraceDepth;
+  int StringDepth;
+  int HexString;
+  int InComment;
+  int Escape;
+  int Unsplittable;
+} EPS_Plan;
+
+/**
+ *  Destination of the segmented input. Either compressed straight to y
+ *  with the state in w, or (if Plan is non-NULL) recorded in the plan.
+ */
+typedef struct{
+  IO_State *y;
+  EPS_Workspace *w;
+  const EPS_Options *Options;
+  EPS_Plan *Plan;
+  /* Name and length of the last string defined by a "/Name Length string
+     def" line, which image data may be read into */
+  char ImageString[ IMAGENAME ];
+  unsigned long ImageStringLength;
+} EPS_Segmenter;
+
+/**
+ *  Append an empty piece to the plan. Returns NULL if out of memory.
+ */
+static EPS_Piece *plan_append( EPS_Plan *p )
+{
+  EPS_Piece *piece, *newPieces;
+  size_t newCapacity;
+  
+  if( p->OutOfMemory ) return NULL;
+  if( p->NumPieces == p->Capacity )
+  {
+    newCapacity = p->Capacity ? 2*p->Capacity : 64;
+    newPieces = (EPS_Piece *)realloc( p->Pieces, newCapacity*sizeof( EPS_Piece ) );
+    if( newPieces == NULL )
+    {
+      p->OutOfMemory = 1;
+      return NULL;
+    }
+    p->Pieces = newPieces;
+    p->Capacity = newCapacity;
+  }
+  piece = &p->Pieces[ p->NumPieces++ ];
+  memset( piece, 0, sizeof( *piece ) );
+  return piece;
+}
+
+/**
+ *  Append a piece to the plan, merging contiguous copied ranges.
+ */
+static void plan_add( EPS_Plan *p, int Compressed, size_t Start, size_t Length )
+{
+  EPS_Piece *last;
+  
+  if( p->OutOfMemory ) return;
+  if( !Compressed && p->NumPieces > 0 )
+  {
+    last = &p->Pieces[ p->NumPieces-1 ];
+    if( !last->Compressed && last->Output == NULL && last->Image == NULL &&
+        last->Start + last->Length == Start )
+    {
+      last->Length += Length;
+      return;
+    }
+  }
+  last = plan_append( p );
+  if( last == NULL ) return;
+  last->Compressed = Compressed;
+  last->Start = Start;
+  last->Length = Length;
+  if( Compressed )
+  {
+    p->BraceDepth = 0;
+    p->StringDepth = 0;
+    p->HexString = 0;
+    p->InComment = 0;
+    p->Escape = 0;
+    p->Unsplittable = 0;
+  }
+}
+
+/**
+ *  Track the PostScript syntax of a line added to a compressed piece.
+ */
+static void plan_scan( EPS_Plan *p, const char *x, size_t n )
+{
+  size_t ii;
+  char c;
+  
+  for( ii=0; ii<n; ii++ )
+  {
+    c = x[ii];
+    if( p->InComment )
+    {
+      if( c == '\n' || c == '\r' ) p->InComment = 0;
+    }
+    else if( p->StringDepth > 0 )
+    {
+      if( p->Escape ) p->Escape = 0;
+      else if( c == '\\' ) p->Escape = 1;
+      else if( c == '(' ) p->StringDepth++;
+      else if( c == ')' ) p->StringDepth--;
+    }
+    /* Hex strings end at '>', ASCII85 strings (<~ ... ~>) at '~>' */
+    else if( p->HexString == 1 )
+    {
+      if( c == '>' ) p->HexString = 0;
+    }
+    else if( p->HexString == 2 )
+    {
+      if( c == '~' ) p->HexString = 3;
+    }
+    else if( p->HexString == 3 )
+    {
+      if( c == '>' ) p->HexString = 0;
+      else if( c != '~' ) p->HexString = 2;
+    }
+    else switch( c )
+    {
+      case '%': p->InComment = 1; break;
+      case '(': p->StringDepth = 1; break;
+      case '{': p->BraceDepth++; break;
+      case '}': if( --p->BraceDepth < 0 ) p->Unsplittable = 1; break;
+      case '<':
+        if( ii+1 < n && x[ii+1] == '<' ) ii++;
+        else if( ii+1 < n && x[ii+1] == '~' ) { p->HexString = 2; ii++; }
+        else p->HexString = 1;
+        break;
+      case 'c':
+        if( n-ii >= 11 && !memcmp( x+ii, "currentfile", 11 ) ) p->Unsplittable = 1;
+        break;
+    }
+  }
+}
+
+/**
+ *  Output a range of the input as-is.
+ */
+static void seg_copy( EPS_Segmenter *s, const char *x, size_t n )
+{
+  if( s->Plan != NULL ) plan_add( s->Plan, 0, x - s->Plan->Input, n );
+  else io_write( x, n, s->y );
+}
+
+/**
+ *  Output Text in place of the n characters of the input at x.
+ */
+static void seg_patch( EPS_Segmenter *s, const char *x, size_t n, const char *Text, size_t TextLength )
+{
+  EPS_Plan *p = s->Plan;
+  EPS_Piece *piece;
+  
+  if( p == NULL )
+  {
+    io_write( Text, TextLength, s->y );
+    return;
+  }
+  piece = plan_append( p );
+  if( piece == NULL ) return;
+  piece->Start = x - p->Input;
+  piece->Length = n;
+  piece->Output = (char *)malloc( TextLength > 0 ? TextLength : 1 );
+  if( piece->Output == NULL )
+  {
+    p->OutOfMemory = 1;
+    return;
+  }
+  memcpy( piece->Output, Text, TextLength );
+  piece->OutputLength = TextLength;
+}
+
+/**
+ *  Start a new compressed segment, beginning at x.
+ */
+static void seg_begin( EPS_Segmenter *s, const char *x )
+{
+  if( s->Plan != NULL )
+  {
+    plan_add( s->Plan, 1, x - s->Plan->Input, 0 );
+    return;
+  }
+  IO_State_Init( s->y );
+  s->y->Binary = !s->Options->Ascii85;
+  if( s->Options->Method == EPS_FLATE )
+  {
+    io_puts( s->y->Binary ? FLATE_BINARY_HEADER : FLATE_HEADER, s->y );
+    Flate_Begin( s->w->f, s->y );
+    return;
+  }
+  LZW_State_Init( s->w->z );
+  s->w->z->Adaptive = s->Options->AdaptiveReset;
+  s->w->z->Lookups = 0;
+  s->w->z->Probes = 0;
+  s->w->z->Resets = 0;
+  io_puts( s->y->Binary ? LZW_BINARY_HEADER : LZW_HEADER, s->y );
+  asciistreamout( CLEARTABLE, s->y, s->w->z );
+}
+
+/**
+ *  Add a range of the input to the current compressed segment. When
+ *  planning, a long segment is split where possible at the start of one
+ *  of the lines in the range.
+ */
+static void seg_data( EPS_Segmenter *s, const char *x, size_t n )
+{
+  EPS_Plan *p = s->Plan;
+  const char *eol;
+  size_t length;
+  
+  /* When planning, the range is taken a line at a time, as the segment
+     can only be split at the start of a line. */
+  if( p != NULL )
+  {
+    while( n > 0 && !p->OutOfMemory )
+    {
+      eol = (const char *)memchr( x, '\n', n );
+      length = eol != NULL ? (size_t)( eol - x ) + 1 : n;
+      if( p->Pieces[ p->NumPieces-1 ].Length >= SPLITSIZE && !p->Unsplittable &&
+          p->BraceDepth == 0 && p->StringDepth == 0 && p->HexString == 0 && !p->InComment )
+      {
+        p->Pieces[ p->NumPieces-1 ].Newline = 1;
+        plan_add( p, 1, x - p->Input, 0 );
+        if( p->OutOfMemory ) return;
+      }
+      p->Pieces[ p->NumPieces-1 ].Length += length;
+      plan_scan( p, x, length );
+      x += length;
+      n -= length;
+    }
+    return;
+  }
+  if( s->Options->Method == EPS_FLATE ) Flate( x, n, s->w->f, s->y );
+  else LZW_Block( x, n, s->y, s->w->z );
+}
+
+/**
+ *  End the current compressed segment, optionally followed by a newline.
+ */
+static void seg_end( EPS_Segmenter *s, int Newline )
+{
+  if( s->Plan != NULL )
+  {
+    if( !s->Plan->OutOfMemory ) s->Plan->Pieces[ s->Plan->NumPieces-1 ].Newline = Newline;
+    return;
+  }
+  if( s->Options->Method == EPS_FLATE ) Flate_End( s->w->f, s->y );
+  else
+  {
+    NotInDictionary( NULL, s->y, s->w->z );
+    asciistreamout( ENDOFDATA, s->y, s->w->z );
+    if( s->y->Stats != NULL )
+    {
+      s->y->Stats->Lookups += s->w->z->Lookups;
+      s->y->Stats->Probes += s->w->z->Probes;
+      s->y->Stats->Resets += s->w->z->Resets;
+    }
+  }
+  asciistreamout_cleanup( s->y );
+  if( Newline ) io_putc( '\n', s->y );
+}
+
+/* Segmenter modes: copying DSC comments, looking ahead for the next DSC
+   comment before deciding whether to compress, and compressing. */
+#define SEG_COPY 0
+#define SEG_LOOKAHEAD 1
+#define SEG_COMPRESS 2
+
+/**
+ *  Write out the input from Start to End. Look-ahead that hasn't been
+ *  decided on is copied, as it is at the end of the input.
+ */
+static void seg_output( EPS_Segmenter *s, int Mode, size_t Start, size_t End )
+{
+  if( Mode == SEG_COMPRESS ) seg_data( s, s->y->InBuffer + Start, End - Start );
+  else seg_copy( s, s->y->InBuffer + Start, End - Start );
+}
+
+/**
+ *  Read more of the input, first writing out what has been decided up to
+ *  Position. Start is the first character not yet written out, and the
+ *  character before it is kept so that line starts can still be found.
+ */
+static void seg_read_more( EPS_Segmenter *s, int Mode, size_t *Start, size_t *Position )
+{
+  size_t shift;
+  
+  if( Mode != SEG_LOOKAHEAD )
+  {
+    seg_output( s, Mode, *Start, *Position );
+    *Start = *Position;
+  }
+  shift = io_read_more( s->y, *Start > 0 ? *Start-1 : 0 );
+  *Start -= shift;
+  *Position -= shift;
+}
+
+/**
+ *  Pad the bounding box comment at Position, if it is one. The input
+ *  before it is written out, then the comment with its four values
+ *  rewritten; Start and Position are left after the last value, so that
+ *  the rest of the line is copied as-is. Values are written with as many
+ *  decimal places as they had, and comments whose values can't be read
+ *  (e.g. "(atend)") are left alone.
+ */
+static void seg_bounding_box( EPS_Segmenter *s, size_t *Start, size_t *Position )
+{
+  static const char *Comments[] = { "%%BoundingBox:", "%%HiResBoundingBox:", "%%PageBoundingBox:" };
+  IO_State *y = s->y;
+  const char *x, *eol;
+  char text[ BBOXLINE + 8*BBOXVALUE ], number[ BBOXVALUE ];
+  size_t ii, jj, n, length = 0, first, decimals;
+  double value;
+  int kk, digits;
+  
+  /* Get the whole line into the window, if it isn't too long */
+  while( y->InLength - *Position < BBOXLINE && !io_eof( y ) &&
+         memchr( y->InBuffer + *Position, '\n', y->InLength - *Position ) == NULL )
+    seg_read_more( s, SEG_COPY, Start, Position );
+  x = y->InBuffer + *Position;
+  n = y->InLength - *Position;
+  eol = (const char *)memchr( x, '\n', n < BBOXLINE ? n : BBOXLINE );
+  if( eol != NULL ) n = eol - x;
+  else if( n >= BBOXLINE ) return;
+  
+  for( kk=0; kk<3; kk++ )
+  {
+    length = strlen( Comments[kk] );
+    if( n >= length && !memcmp( x, Comments[kk], length ) ) break;
+  }
+  if( kk == 3 ) return;
+  memcpy( text, x, length );
+  ii = jj = length;
+  for( kk=0; kk<4; kk++ )
+  {
+    /* The values are separated by spaces, which are kept */
+    first = ii;
+    while( ii < n && ( x[ii] == ' ' || x[ii] == '\t' ) ) ii++;
+    if( kk > 0 && ii == first ) return;
+    memcpy( text + jj, x + first, ii - first );
+    jj += ii - first;
+    
+    first = ii;
+    digits = 0;
+    decimals = 0;
+    if( ii < n && ( x[ii] == '-' || x[ii] == '+' ) ) ii++;
+    for( ; ii < n && isdigit( (unsigned char)x[ii] ); ii++ ) digits = 1;
+    if( ii < n && x[ii] == '.' )
+      for( ii++; ii < n && isdigit( (unsigned char)x[ii] ); ii++, decimals++ ) digits = 1;
+    if( !digits || ii - first >= BBOXVALUE ) return;
+    if( s->Options->Pad[kk] == 0 )
+    {
+      memcpy( text + jj, x + first, ii - first );
+      jj += ii - first;
+      continue;
+    }
+    memcpy( number, x + first, ii - first );
+    number[ ii - first ] = '\0';
+    value = strtod( number, NULL ) + ( kk < 2 ? -s->Options->Pad[kk] : s->Options->Pad[kk] );
+    jj += sprintf( text + jj, "%.*f", (int)decimals, value );
+  }
+  if( ii < n && x[ii] != ' ' && x[ii] != '\t' && x[ii] != '\r' ) return;
+  
+  seg_copy( s, y->InBuffer + *Start, *Position - *Start );
+  seg_patch( s, x, ii, text, jj );
+  *Position += ii;
+  *Start = *Position;
+}
+
+/**
+ *  Release an image and its samples.
+ */
+static void image_free( EPS_Image *img )
+{
+  if( img == NULL ) return;
+  free( img->Samples );
+  free( img );
+}
+
+/**
+ *  Test for a PostScript delimiter or white space, which ends a token.
+ */
+static int image_delimiter( char c )
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\0' ||
+    strchr( "()<>[]{}/%", c ) != NULL;
+}
+
+/**
+ *  Skip the spaces and tabs from x[ii].
+ */
+static size_t image_space( const char *x, size_t n, size_t ii )
+{
+  while( ii < n && ( x[ii] == ' ' || x[ii] == '\t' ) ) ii++;
+  return ii;
+}
+
+/**
+ *  Match the token Word at x[ii], returning the index after it, or 0 if
+ *  it isn't there. The token must be followed by a delimiter.
+ */
+static size_t image_token( const char *x, size_t n, size_t ii, const char *Word )
+{
+  size_t length = strlen( Word );
+  
+  if( n - ii <= length || memcmp( x+ii, Word, length ) || !image_delimiter( x[ii+length] ) )
+    return 0;
+  return ii + length;
+}
+
+/**
+ *  Read the unsigned integer at x[ii] into Value, returning the index
+ *  after it, or 0 if there isn't one (or it is too large to be a size).
+ */
+static size_t image_number( const char *x, size_t n, size_t ii, unsigned long *Value )
+{
+  size_t first = ii;
+  
+  *Value = 0;
+  for( ; ii < n && isdigit( (unsigned char)x[ii] ); ii++ )
+  {
+    if( *Value > IMAGEMAXSAMPLES ) return 0;
+    *Value = 10*( *Value ) + (unsigned long)( x[ii] - '0' );
+  }
+  if( ii == first || ii == n || !image_delimiter( x[ii] ) ) return 0;
+  return ii;
+}
+
+/**
+ *  Read the name at x[ii] into Name, returning the index after it, or 0
+ *  if there isn't one (or it is too long).
+ */
+static size_t image_name( const char *x, size_t n, size_t ii, char *Name )
+{
+  size_t first = ii;
+  
+  while( ii < n && !image_delimiter( x[ii] ) ) ii++;
+  if( ii == first || ii == n || ii - first >= IMAGENAME ) return 0;
+  memcpy( Name, x + first, ii - first );
+  Name[ ii - first ] = '\0';
+  return ii;
+}
+
+/**
+ *  Note the string defined by the "/Name Length string def" line at x,
+ *  if it is one.
+ */
+static void image_string( EPS_Segmenter *s, const char *x, size_t n )
+{
+  char name[ IMAGENAME ];
+  unsigned long length;
+  size_t ii;
+  
+  if( ( ii = image_name( x, n, 1, name ) ) == 0 ) return;
+  if( ( ii = image_number( x, n, image_space( x, n, ii ), &length ) ) == 0 ) return;
+  if( ( ii = image_token( x, n, image_space( x, n, ii ), "string" ) ) == 0 ) return;
+  if( image_token( x, n, image_space( x, n, ii ), "def" ) == 0 ) return;
+  strcpy( s->ImageString, name );
+  s->ImageStringLength = length;
+}
+
+/**
+ *  Parse the image header at x, as Matlab writes it for a bitmap:
+ *    800 600 8 [800 0 0 -600 0 600] {currentfile picstr readhexstring pop}
+ *    false 3 colorimage
+ *  all on one line, or with "image" for a greyscale one. The string read
+ *  into must be the last one defined, and be filled a whole number of
+ *  times by the samples. Returns the length of the header, or 0 if it
+ *  isn't one that can be re-encoded.
+ */
+static size_t image_header( EPS_Segmenter *s, const char *x, size_t n, EPS_Image *img )
+{
+  char name[ IMAGENAME ];
+  unsigned long bits, colors = 1;
+  size_t ii, first;
+  
+  if( ( ii = image_number( x, n, 0, &img->Width ) ) == 0 ) return 0;
+  if( ( ii = image_number( x, n, image_space( x, n, ii ), &img->Height ) ) == 0 ) return 0;
+  if( ( ii = image_number( x, n, image_space( x, n, ii ), &bits ) ) == 0 || bits != 8 ) return 0;
+  
+  /* The matrix is kept as it is */
+  first = ii = image_space( x, n, ii );
+  if( ii == n || x[ii] != '[' ) return 0;
+  while( ++ii < n && x[ii] != ']' )
+    if( x[ii] == '\0' || ( !isdigit( (unsigned char)x[ii] ) && strchr( " \t.-+eE", x[ii] ) == NULL ) )
+      return 0;
+  if( ii == n ) return 0;
+  ii++;
+  memcpy( img->Matrix, x + first, ii - first );
+  img->Matrix[ ii - first ] = '\0';
+  
+  ii = image_space( x, n, ii );
+  if( ii == n || x[ii] != '{' ) return 0;
+  if( ( ii = image_token( x, n, image_space( x, n, ii+1 ), "currentfile" ) ) == 0 ) return 0;
+  if( ( ii = image_name( x, n, image_space( x, n, ii ), name ) ) == 0 ) return 0;
+  if( ( ii = image_token( x, n, image_space( x, n, ii ), "readhexstring" ) ) == 0 ) return 0;
+  if( ( ii = image_token( x, n, image_space( x, n, ii ), "pop" ) ) == 0 ) return 0;
+  ii = image_space( x, n, ii );
+  if( ii == n || x[ii] != '}' ) return 0;
+  ii = image_space( x, n, ii+1 );
+  if( ( first = image_token( x, n, ii, "false" ) ) != 0 )
+  {
+    ii = image_number( x, n, image_space( x, n, first ), &colors );
+    if( ii == 0 || ( colors != 3 && colors != 4 ) ) return 0;
+    ii = image_token( x, n, image_space( x, n, ii ), "colorimage" );
+  }
+  else ii = image_token( x, n, ii, "image" );
+  /* The data starts after the white space following the operator */
+  if( ii == 0 || ( x[ii] != ' ' && x[ii] != '\t' && x[ii] != '\r' && x[ii] != '\n' ) ) return 0;
+  
+  if( s->ImageStringLength == 0 || strcmp( name, s->ImageString ) ) return 0;
+  if( img->Width == 0 || img->Height == 0 || img->Width > IMAGEMAXSAMPLES/img->Height/colors )
+    return 0;
+  img->Colors = (int)colors;
+  img->NumSamples = (size_t)img->Width*img->Height*colors;
+  if( img->NumSamples % s->ImageStringLength ) return 0;
+  memcpy( img->Header, x, ii );
+  img->HeaderLength = ii;
+  return ii;
+}
+
+/**
+ *  Value of a hex digit, or -1 if it isn't one.
+ */
+static int image_hex( char c )
+{
+  if( c >= '0' && c <= '9' ) return c - '0';
+  c |= 0x20;
+  if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+  return -1;
+}
+
+/* Cost of a filtered byte, taken as a signed difference */
+#define PNG_COST(r) ( (r) < 128 ? (r) : 256 - (r) )
+
+/**
+ *  Paeth predictor of a sample from the ones to its left (a), above (b)
+ *  and above left (c).
+ */
+static int png_paeth( int a, int b, int c )
+{
+  int p = a + b - c, pa = abs( p-a ), pb = abs( p-b ), pc = abs( p-c );
+  
+  if( pa <= pb && pa <= pc ) return a;
+  return pb <= pc ? b : c;
+}
+
+/**
+ *  Filter a row of Length samples for the PNG predictor into Out: the
+ *  filter type, then the filtered row. Each of the five filters is
+ *  tried, and the one with the smallest sum of absolute differences is
+ *  kept, as libpng does. Prior is the row above (all zero for the first
+ *  row), and Bpp the number of samples per pixel.
+ */
+static void png_filter_row( const unsigned char *Row, const unsigned char *Prior, size_t Length,
+  int Bpp, unsigned char *Out )
+{
+  unsigned long long cost[5] = { 0, 0, 0, 0, 0 };
+  size_t ii, bpp = (size_t)Bpp;
+  int a, b, c, x, p = 0, best = 0, kk;
+  
+  for( ii=0; ii<Length; ii++ )
+  {
+    x = Row[ii];
+    a = ii >= bpp ? Row[ii-bpp] : 0;
+    b = Prior[ii];
+    c = ii >= bpp ? Prior[ii-bpp] : 0;
+    cost[0] += PNG_COST( x );
+    cost[1] += PNG_COST( ( x - a ) & 0xff );
+    cost[2] += PNG_COST( ( x - b ) & 0xff );
+    cost[3] += PNG_COST( ( x - ( ( a + b ) >> 1 ) ) & 0xff );
+    cost[4] += PNG_COST( ( x - png_paeth( a, b, c ) ) & 0xff );
+  }
+  for( kk=1; kk<5; kk++ )
+    if( cost[kk] < cost[best] ) best = kk;
+  
+  Out[0] = (unsigned char)best;
+  for( ii=0; ii<Length; ii++ )
+  {
+    a = ii >= bpp ? Row[ii-bpp] : 0;
+    b = Prior[ii];
+    c = ii >= bpp ? Prior[ii-bpp] : 0;
+    switch( best )
+    {
+      case 1: p = a; break;
+      case 2: p = b; break;
+      case 3: p = ( a + b ) >> 1; break;
+      case 4: p = png_paeth( a, b, c ); break;
+    }
+    Out[ii+1] = (unsigned char)( Row[ii] - p );
+  }
+}
+
+/**
+ *  Compress the samples of an image into y, a row at a time through the
+ *  PNG predictor and Flate. The data is ended (with "~>", if ASCII85
+ *  encoded) as a compressed segment is.
+ */
+static void image_encode( const EPS_Image *img, Flate_State *f, IO_State *y )
+{
+  size_t length = (size_t)img->Width*img->Colors, ii;
+  unsigned char *prior, *row;
+  
+  prior = (unsigned char *)calloc( 2*length + 1, 1 );
+  if( prior == NULL )
+  {
+    y->OutOfMemory = 1;
+    return;
+  }
+  row = prior + length;
+  Flate_Begin( f, y );
+  for( ii=0; ii<img->Height; ii++ )
+  {
+    png_filter_row( img->Samples + ii*length, ii > 0 ? img->Samples + (ii-1)*length : prior,
+      length, img->Colors, row );
+    Flate( (const char *)row, length+1, f, y );
+  }
+  Flate_End( f, y );
+  asciistreamout_cleanup( y );
+  free( prior );
+}
+
+/**
+ *  Downsample an image in place by Factor in each direction, averaging
+ *  each block of samples (the blocks at the right and bottom edges may
+ *  be smaller). The matrix is scaled to match, so that the image covers
+ *  the same area; if it can't be read, the image is left as it is.
+ */
+static void image_downsample( EPS_Image *img, int Factor )
+{
+  unsigned long width, height, ii, jj, kk, ll, sum[4], count;
+  size_t k = Factor > 1 ? (size_t)Factor : 1, row = (size_t)img->Width*img->Colors;
+  const unsigned char *x;
+  unsigned char *out = img->Samples;
+  const char *p = img->Matrix + 1;
+  char *end;
+  double m[6];
+  int cc;
+  
+  if( k == 1 ) return;
+  for( cc=0; cc<6; cc++, p=end )
+  {
+    m[cc] = strtod( p, &end );
+    if( end == p ) return;
+  }
+  while( *p == ' ' || *p == '\t' ) p++;
+  if( *p != ']' ) return;
+  
+  width = ( img->Width + k - 1 )/k;
+  height = ( img->Height + k - 1 )/k;
+  /* The output never overtakes the blocks still to be read */
+  for( jj=0; jj<height; jj++ )
+    for( ii=0; ii<width; ii++ )
+    {
+      memset( sum, 0, sizeof( sum ) );
+      count = 0;
+      for( ll=jj*k; ll<(jj+1)*k && ll<img->Height; ll++ )
+        for( kk=ii*k; kk<(ii+1)*k && kk<img->Width; kk++, count++ )
+        {
+          x = img->Samples + ll*row + kk*img->Colors;
+          for( cc=0; cc<img->Colors; cc++ ) sum[cc] += x[cc];
+        }
+      for( cc=0; cc<img->Colors; cc++ )
+        *out++ = (unsigned char)( ( sum[cc] + count/2 )/count );
+    }
+  
+  /* Scale the image space by the change in size */
+  m[0] *= (double)width/img->Width;
+  m[2] *= (double)width/img->Width;
+  m[4] *= (double)width/img->Width;
+  m[1] *= (double)height/img->Height;
+  m[3] *= (double)height/img->Height;
+  m[5] *= (double)height/img->Height;
+  sprintf( img->Matrix, "[%.9g %.9g %.9g %.9g %.9g %.9g]", m[0], m[1], m[2], m[3], m[4], m[5] );
+  img->Width = width;
+  img->Height = height;
+  img->NumSamples = (size_t)width*height*img->Colors;
+}
+
+/**
+ *  Write out a re-encoded image, downsampled first if asked for:
+ *  PostScript that reads the new data in place of the hex samples, then
+ *  the data itself. A failure to encode it is recorded in y as running
+ *  out of memory.
+ */
+static void image_output( EPS_Image *img, const EPS_Options *o, Flate_State *f, IO_State *y )
+{
+  IO_State data;
+  char header[ sizeof( IMAGE_HEADER ) + IMAGEHEADER + 128 ], op[ 32 ];
+  int n;
+  
+  image_downsample( img, o->Downsample );
+  IO_State_Clear( &data );
+  data.Binary = !o->Ascii85;
+  data.Stats = y->Stats;
+  image_encode( img, f, &data );
+  if( data.OutOfMemory ) y->OutOfMemory = 1;
+  else
+  {
+    if( img->Colors == 1 ) strcpy( op, "image" );
+    else sprintf( op, "false %d colorimage", img->Colors );
+    n = sprintf( header, IMAGE_HEADER, (unsigned long)data.OutLength,
+      o->Ascii85 ? "/ASCII85Decode filter" : "", img->Width, img->Colors, img->Width,
+      img->Height, img->Matrix, op );
+    io_write( header, n, y );
+    io_write( data.OutBuffer, data.OutLength, y );
+  }
+  free( data.OutBuffer );
+}
+
+/**
+ *  Write out an image that couldn't be re-encoded, as its data ran out,
+ *  the way it was read: the header, then the Count samples decoded (and
+ *  the half sample High, if any) in hex. Only needed serially, as the
+ *  data has gone from the window of a streamed input.
+ */
+static void image_rehex( EPS_Segmenter *s, int Mode, const EPS_Image *img, size_t Count, int High )
+{
+  static const char Hex[] = "0123456789abcdef";
+  char line[ 65 ];
+  size_t ii, n = 0;
+  
+  if( Mode == SEG_COMPRESS ) seg_data( s, img->Header, img->HeaderLength );
+  else seg_copy( s, img->Header, img->HeaderLength );
+  for( ii=0; ii<=Count; ii++ )
+  {
+    if( n == sizeof( line ) || ( ii == Count && n > 0 ) )
+    {
+      if( Mode == SEG_COMPRESS ) seg_data( s, line, n );
+      else seg_copy( s, line, n );
+      n = 0;
+    }
+    if( ii == Count ) break;
+    if( n == 0 ) line[ n++ ] = '\n';
+    line[ n++ ] = Hex[ img->Samples[ii] >> 4 ];
+    line[ n++ ] = Hex[ img->Samples[ii] & 15 ];
+  }
+  if( High >= 0 )
+  {
+    if( Mode == SEG_COMPRESS ) seg_data( s, &Hex[ High ], 1 );
+    else seg_copy( s, &Hex[ High ], 1 );
+  }
+}
+
+/**
+ *  Re-encode the image whose header is the line at Position, if it is
+ *  one, and note any string defined there for image data to be read
+ *  into. The input before the image is written out first, then its
+ *  samples are decoded, reading through a streamed input as they go so
+ *  that an image can be larger than the window. The re-encoded image
+ *  replaces the input up to the end of the hex data, and a compressed
+ *  segment is ended before it. Returns non-zero if the line has been
+ *  dealt with, with Start and Position moved past it.
+ */
+static int seg_image( EPS_Segmenter *s, int *Mode, size_t *Start, size_t *Position )
+{
+  IO_State *y = s->y;
+  EPS_Image *img;
+  EPS_Piece *piece;
+  const char *x;
+  size_t n, p, header, count = 0;
+  int high = -1, v;
+  
+  if( *Position == y->InLength ) return 0;
+  if( y->InBuffer[ *Position ] != '/' && !isdigit( (unsigned char)y->InBuffer[ *Position ] ) )
+    return 0;
+  
+  /* Get the whole line into the window, if it isn't too long */
+  while( y->InLength - *Position < IMAGEHEADER && !io_eof( y ) &&
+         memchr( y->InBuffer + *Position, '\n', y->InLength - *Position ) == NULL )
+    seg_read_more( s, *Mode, Start, Position );
+  x = y->InBuffer + *Position;
+  n = y->InLength - *Position;
+  if( n > IMAGEHEADER ) n = IMAGEHEADER;
+  if( x[0] == '/' )
+  {
+    image_string( s, x, n );
+    return 0;
+  }
+  img = (EPS_Image *)malloc( sizeof( EPS_Image ) );
+  if( img == NULL ) return 0;
+  header = image_header( s, x, n, img );
+  img->Samples = header > 0 ? (unsigned char *)malloc( img->NumSamples ) : NULL;
+  if( img->Samples == NULL )
+  {
+    free( img );
+    return 0;
+  }
+  
+  /* Write out what comes before the image */
+  seg_output( s, *Mode, *Start, *Position );
+  *Start = *Position;
+  if( *Mode == SEG_LOOKAHEAD ) *Mode = SEG_COPY;
+  
+  /* Decode the samples, skipping anything that isn't a hex digit as
+     readhexstring does */
+  p = *Position + header;
+  while( count < img->NumSamples )
+  {
+    if( p == y->InLength )
+    {
+      if( io_eof( y ) ) break;
+      p -= io_read_more( y, p-1 );
+      continue;
+    }
+    for( ; p < y->InLength && count < img->NumSamples; p++ )
+    {
+      v = image_hex( y->InBuffer[p] );
+      if( v < 0 ) continue;
+      if( high < 0 ) high = v;
+      else
+      {
+        img->Samples[ count++ ] = (unsigned char)( ( high << 4 ) | v );
+        high = -1;
+      }
+    }
+  }
+  
+  /* If the data runs out, the image is left as it is. When planning, the
+     input is all in memory, so it can just be scanned again. */
+  if( count < img->NumSamples )
+  {
+    if( s->Plan != NULL )
+    {
+      image_free( img );
+      return 0;
+    }
+    image_rehex( s, *Mode, img, count, high );
+    image_free( img );
+    *Start = *Position = p;
+    return 1;
+  }
+  
+  if( *Mode == SEG_COMPRESS ) seg_end( s, 1 );
+  *Mode = SEG_COPY;
+  if( y->Stats != NULL ) y->Stats->Images++;
+  if( s->Plan != NULL )
+  {
+    piece = plan_append( s->Plan );
+    if( piece != NULL )
+    {
+      piece->Start = *Position;
+      piece->Length = p - *Position;
+      piece->Image = img;
+    }
+    else image_free( img );
+  }
+  else
+  {
+    image_output( img, s->Options, s->w->f, y );
+    image_free( img );
+  }
+  *Start = *Position = p;
+  return 1;
+}
+
+/**
+ *  Find the end of the next line in x[0..n) that is followed by a '%',
+ *  as only those lines can be followed by a DSC comment. x[-1] must be
+ *  valid. Returns a pointer to the newline, or NULL if there isn't one.
+ */
+static const char *find_comment_line( const char *x, size_t n )
+{
+  const char *p = x, *end = x + n;
+  
+  while( ( p = (const char *)memchr( p, '%', end - p ) ) != NULL )
+  {
+    if( p[-1] == '\n' ) return p-1;
+    p++;
+  }
+  return NULL;
+}
+
+/**
+ *  Split an EPS file into segments. Anything between DSC comments is
+ *  compressed, while the comments themselves are passed through as-is.
+ *
+ *  The input is scanned for the line starts that matter in each mode,
+ *  rather than line by line: while compressing, only lines that start
+ *  with a '%' (unless images are being re-encoded, when every line
+ *  matters). Apart from the look-ahead (which is held back until it has
+ *  been decided on) everything before the scan position is written out
+ *  before more of the input is read, so a streamed input is compressed in
+ *  constant memory however long its lines are.
+ */
+static int EpsSegment( IO_State *y, EPS_Segmenter *s )
+{
+  const unsigned char eps_magic[] = {0xc5,0xd0,0xd3,0xc6};
+  const char *eol;
+  size_t start = 0, pos = 0, limit, grace, lineoff = 0;
+  int mode = SEG_COPY;
+  int lines = 0;
+  int dsc, pad, images = s->Options->Images;
+  
+  /* Check the header, which is copied along with the rest of its line */
+  while( y->InLength < 11 && !io_eof( y ) ) seg_read_more( s, SEG_LOOKAHEAD, &start, &pos );
+  if( ( y->InLength < 11 || memcmp( y->InBuffer, "%!PS-Adobe-", 11 ) ) &&
+      ( y->InLength < 4 || memcmp( y->InBuffer, eps_magic, 4 ) ) )
+    return y->ReadError ? EPS_READ_ERROR : EPS_NOT_EPS;
+  pad = s->Options->Pad[0] || s->Options->Pad[1] || s->Options->Pad[2] || s->Options->Pad[3];
+  
+  for(;;)
+  {
+    /* Find the start of the next line that matters. Look-ahead is limited
+       to where the current line (starting lineoff into it) would make up
+       the DSCGRACE lines, each DSCGRACELINE characters of it counting as
+       one, after which it is compressed. Otherwise the search is done a
+       block at a time, except (as it can only be split at the start of a
+       line) for a segment being planned. */
+    limit = y->InLength;
+    if( mode == SEG_LOOKAHEAD )
+    {
+      grace = start + lineoff + (size_t)( DSCGRACE - lines )*DSCGRACELINE;
+      if( limit > grace ) limit = grace;
+    }
+    else if( limit - pos > SEGBLOCKSIZE && ( mode == SEG_COPY || s->Plan == NULL ) )
+      limit = pos + SEGBLOCKSIZE;
+    if( mode == SEG_COMPRESS && !images ) eol = find_comment_line( y->InBuffer + pos, limit - pos );
+    else eol = (const char *)memchr( y->InBuffer + pos, '\n', limit - pos );
+    if( eol == NULL )
+    {
+      if( limit < y->InLength )
+      {
+        if( mode == SEG_LOOKAHEAD )
+        {
+          seg_begin( s, y->InBuffer + start );
+          if( y->Stats != NULL ) y->Stats->Segments++;
+          mode = SEG_COMPRESS;
+        }
+        else
+        {
+          seg_output( s, mode, start, limit );
+          start = limit;
+        }
+        pos = limit;
+        continue;
+      }
+      if( io_eof( y ) ) break;
+      pos = limit;
+      seg_read_more( s, mode, &start, &pos );
+      continue;
+    }
+    pos = eol - y->InBuffer + 1;
+    
+    /* The first two characters of the line tell if it's a DSC comment */
+    while( y->InLength - pos < 2 && !io_eof( y ) ) seg_read_more( s, mode, &start, &pos );
+    dsc = y->InLength - pos >= 2 && y->InBuffer[pos] == '%' && y->InBuffer[pos+1] == '%';
+    if( images && !dsc && seg_image( s, &mode, &start, &pos ) )
+    {
+      lineoff = pos - start;
+      continue;
+    }
+    if( mode == SEG_COPY )
+    {
+      /* Otherwise, determine if we need to start compression by looking
+         ahead for another DSC comment in the next DSCGRACE lines. */
+      if( !dsc )
+      {
+        seg_copy( s, y->InBuffer + start, pos - start );
+        start = pos;
+        mode = SEG_LOOKAHEAD;
+        lines = 1;
+        lineoff = 0;
+      }
+    }
+    else if( mode == SEG_LOOKAHEAD )
+    {
+      /* If we find a comment, don't start compressing, otherwise start
+         once we have enough lines. */
+      lines += (int)( ( pos - start - lineoff + DSCGRACELINE-1 )/DSCGRACELINE );
+      lineoff = pos - start;
+      if( dsc ) mode = SEG_COPY;
+      else if( lines >= DSCGRACE )
+      {
+        seg_begin( s, y->InBuffer + start );
+        if( y->Stats != NULL ) y->Stats->Segments++;
+        mode = SEG_COMPRESS;
+      }
+    }
+    /* If we find a DSC comment while compressing, turn compression off */
+    else if( dsc )
+    {
+      seg_data( s, y->InBuffer + start, pos - start );
+      seg_end( s, 1 );
+      start = pos;
+      mode = SEG_COPY;
+    }
+    
+    /* Pad the bounding box as its comment is copied */
+    if( pad && dsc && mode == SEG_COPY ) seg_bounding_box( s, &start, &pos );
+    
+    /* Write out long runs of lines as they go */
+    if( mode != SEG_LOOKAHEAD && pos - start >= SEGBLOCKSIZE )
+    {
+      seg_output( s, mode, start, pos );
+      start = pos;
+    }
+    
+    /* A line start already checked while compressing mustn't be found
+       again */
+    if( mode == SEG_COMPRESS && !images && pos < y->InLength ) pos++;
+  }
+  
+  /* Write out what's left, ending the compressed segment if the file ends
+     while compressing. */
+  seg_output( s, mode, start, y->InLength );
+  if( mode == SEG_COMPRESS ) seg_end( s, 0 );
+  
+  return y->ReadError ? EPS_READ_ERROR : EPS_OK;
+}
+
+#ifdef _WIN32
+typedef HANDLE Pool_Thread;
+#else
+typedef pthread_t Pool_Thread;
+#endif
+
+/**
+ *  State private to each worker thread of the pool, reused for every
+ *  task the worker runs.
+ */
+typedef struct{
+  EPS_Workspace Work;
+  IO_State y;
+} Pool_Worker;
+
+/**
+ *  A task run by the thread pool, given its index and the worker state.
+ */
+typedef void (*Pool_Task)( void *Context, size_t Index, Pool_Worker *w );
+
+/**
+ *  Shared state of the thread pool. Workers take the next task index
+ *  until they run out.
+ */
+typedef struct{
+  Pool_Task Task;
+  void *Context;
+  size_t NumTasks;
+  size_t NextTask;
+#ifdef _WIN32
+  CRITICAL_SECTION Lock;
+#else
+  pthread_mutex_t Lock;
+#endif
+} Pool;
+
+/**
+ *  Worker loop, run by each thread in the pool (including the caller).
+ */
+static void pool_work( Pool *p )
+{
+  Pool_Worker w;
+  size_t ii;
+  
+  w.Work.z = NULL;
+  w.Work.f = NULL;
+  IO_State_Clear( &w.y );
+  for(;;)
+  {
+#ifdef _WIN32
+    EnterCriticalSection( &p->Lock );
+    ii = p->NextTask++;
+    LeaveCriticalSection( &p->Lock );
+#else
+    pthread_mutex_lock( &p->Lock );
+    ii = p->NextTask++;
+    pthread_mutex_unlock( &p->Lock );
+#endif
+    if( ii >= p->NumTasks ) break;
+    p->Task( p->Context, ii, &w );
+  }
+  EPS_Workspace_Free( &w.Work );
+  free( w.y.OutBuffer );
+}
+
+#ifdef _WIN32
+static DWORD WINAPI pool_thread( LPVOID x )
+{
+  pool_work( (Pool *)x );
+  return 0;
+}
+#else
+static void *pool_thread( void *x )
+{
+  pool_work( (Pool *)x );
+  return NULL;
+}
+#endif
+
+/**
+ *  Number of processors available to run threads on.
+ */
+static int Pool_NumProcessors( void )
+{
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  
+  GetSystemInfo( &si );
+  return (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+  
+  return n > 0 ? (int)n : 1;
+#else
+  return 1;
+#endif
+}
+
+/**
+ *  Run NumTasks tasks on up to NumThreads threads (0 for one per
+ *  processor), and wait for them all to finish. The calling thread works
+ *  through tasks as well, so if threads can't be started the tasks are
+ *  still all run.
+ */
+static void Pool_Run( int NumThreads, size_t NumTasks, Pool_Task Task, void *Context )
+{
+  Pool p;
+  Pool_Thread threads[ MAXTHREADS ];
+  int ii, started = 0;
+  
+  if( NumThreads <= 0 ) NumThreads = Pool_NumProcessors();
+  if( NumThreads > MAXTHREADS ) NumThreads = MAXTHREADS;
+  if( (size_t)NumThreads > NumTasks ) NumThreads = NumTasks > 0 ? (int)NumTasks : 1;
+  
+  p.Task = Task;
+  p.Context = Context;
+  p.NumTasks = NumTasks;
+  p.NextTask = 0;
+#ifdef _WIN32
+  InitializeCriticalSection( &p.Lock );
+  for( ii=1; ii<NumThreads; ii++ )
+  {
+    threads[ started ] = CreateThread( NULL, 0, pool_thread, &p, 0, NULL );
+    if( threads[ started ] == NULL ) break;
+    started++;
+  }
+  pool_work( &p );
+  for( ii=0; ii<started; ii++ )
+  {
+    WaitForSingleObject( threads[ii], INFINITE );
+    CloseHandle( threads[ii] );
+  }
+  DeleteCriticalSection( &p.Lock );
+#else
+  pthread_mutex_init( &p.Lock, NULL );
+  for( ii=1; ii<NumThreads; ii++ )
+  {
+    if( pthread_create( &threads[ started ], NULL, pool_thread, &p ) != 0 ) break;
+    started++;
+  }
+  pool_work( &p );
+  for( ii=0; ii<started; ii++ ) pthread_join( threads[ii], NULL );
+  pthread_mutex_destroy( &p.Lock );
+#endif
+}
+
+/**
+ *  Thread pool task compressing one piece of the plan into its own
+ *  output buffer.
+ */
+static void eps_compress_piece( void *Context, size_t Index, Pool_Worker *w )
+{
+  EPS_Plan *p = (EPS_Plan *)Context;
+  EPS_Piece *piece = &p->Pieces[ Index ];
+  EPS_Segmenter s;
+  IO_State out;
+  Stats_Timer t;
+  
+  if( !piece->Compressed && piece->Image == NULL ) return;
+  if( EPS_Workspace_Prepare( &w->Work, piece->Image != NULL ? EPS_FLATE : p->Options->Method ) )
+  {
+    piece->Status = EPS_OUT_OF_MEMORY;
+    return;
+  }
+  IO_State_Clear( &out );
+  out.Stats = p->Stats ? &piece->Stats : NULL;
+  s.y = &out;
+  s.w = &w->Work;
+  s.Options = p->Options;
+  s.Plan = NULL;
+  stats_timer_start( &out, &t );
+  if( piece->Image != NULL ) image_output( piece->Image, p->Options, w->Work.f, &out );
+  else
+  {
+    seg_begin( &s, NULL );
+    seg_data( &s, p->Input + piece->Start, piece->Length );
+    seg_end( &s, piece->Newline );
+  }
+  stats_timer_stop( &out, &t );
+  piece->Output = out.OutBuffer;
+  piece->OutputLength = out.OutLength;
+  piece->Status = io_status( &out );
+}
+
+/**
+ *  Add the counts and stage times of a piece to the statistics.
+ */
+static void stats_add( EPS_Stats *x, const EPS_Stats *Piece )
+{
+  x->Resets += Piece->Resets;
+  x->Lookups += Piece->Lookups;
+  x->Probes += Piece->Probes;
+  x->CompressSeconds += Piece->CompressSeconds;
+  x->Ascii85Seconds += Piece->Ascii85Seconds;
+  x->IoSeconds += Piece->IoSeconds;
+}
+
+/**
+ *  Compress an EPS file. The input and output of y need to be set up
+ *  before calling this function. Serially, the segments are compressed
+ *  straight to the output as the input is scanned, using the state in w
+ *  (or a temporary one if w is NULL). Otherwise the whole input is
+ *  scanned first, the pieces are compressed concurrently, then written
+ *  out in order; for that the input must be held in memory rather than
+ *  streamed.
+ */
+static int eps_compress( IO_State *y, EPS_Workspace *w, const EPS_Options *o )
+{
+  EPS_Segmenter s;
+  EPS_Plan plan;
+  EPS_Piece *piece;
+  EPS_Workspace local;
+  Stats_Timer t;
+  size_t ii;
+  int status;
+  
+  IO_State_Init( y );
+  local.z = NULL;
+  local.f = NULL;
+  s.y = y;
+  s.w = w != NULL ? w : &local;
+  s.Options = o;
+  s.Plan = NULL;
+  s.ImageStringLength = 0;
+  if( o->Threads == 1 )
+  {
+    stats_timer_start( y, &t );
+    if( EPS_Workspace_Prepare( s.w, o->Method ) ||
+        ( o->Images && EPS_Workspace_Prepare( s.w, EPS_FLATE ) ) ) status = EPS_OUT_OF_MEMORY;
+    else status = EpsSegment( y, &s );
+    stats_timer_stop( y, &t );
+    EPS_Workspace_Free( &local );
+  }
+  else
+  {
+    memset( &plan, 0, sizeof( plan ) );
+    plan.Input = y->InBuffer;
+    plan.Options = o;
+    plan.Stats = y->Stats != NULL;
+    s.Plan = &plan;
+    stats_timer_start( y, &t );
+    status = EpsSegment( y, &s );
+    stats_timer_stop( y, &t );
+    if( status == EPS_OK && plan.OutOfMemory ) status = EPS_OUT_OF_MEMORY;
+    if( status == EPS_OK )
+      Pool_Run( o->Threads, plan.NumPieces, eps_compress_piece, &plan );
+    
+    /* Stitch the pieces back together */
+    stats_timer_start( y, &t );
+    for( ii=0; ii<plan.NumPieces; ii++ )
+    {
+      piece = &plan.Pieces[ii];
+      if( status == EPS_OK )
+      {
+        if( ( piece->Compressed || piece->Image != NULL ) && piece->Status != EPS_OK )
+          status = piece->Status;
+        else if( piece->Output != NULL ) io_write( piece->Output, piece->OutputLength, y );
+        else if( !piece->Compressed ) io_write( plan.Input + piece->Start, piece->Length, y );
+      }
+      free( piece->Output );
+      image_free( piece->Image );
+    }
+    stats_timer_stop( y, &t );
+    if( y->Stats != NULL )
+      for( ii=0; ii<plan.NumPieces; ii++ ) stats_add( y->Stats, &plan.Pieces[ii].Stats );
+    free( plan.Pieces );
+  }
+  
+  /* A streamed input has been counted and hashed as it was read */
+  if( y->Stats != NULL )
+  {
+    if( y->fin == NULL )
+    {
+      y->Stats->BytesIn = y->InLength;
+      stats_hash( y, y->InBuffer, y->InLength );
+    }
+    y->Stats->BytesOut = y->OutTotal;
+  }
+  return status != EPS_OK ? status : io_status( y );
+}
+
+/**
+ *  Compress a file on disk, returning the status and the number of
+ *  characters written in Bytes. Any staging buffer already in y is
+ *  reused, and is left for the caller to free. A file compressed in place
+ *  is written to a temporary file first, as the input is still being read
+ *  (or is mapped) while the output is written.
+ */
+static int eps_compress_file( const char *InFile, const char *OutFile, IO_State *y,
+  EPS_Workspace *w, const EPS_Options *o, size_t *Bytes, EPS_Stats *Stats )
+{
+  char *buffer = y->OutBuffer, *tmpFile = NULL;
+  size_t capacity = y->OutCapacity;
+  double t;
+  int status;
+  
+  IO_State_Clear( y );
+  y->OutBuffer = buffer;
+  y->OutCapacity = capacity;
+  y->Stats = Stats;
+  *Bytes = 0;
+  t = stats_start( y );
+  if( io_same_file( InFile, OutFile ) )
+  {
+    tmpFile = (char *)malloc( strlen( OutFile ) + 5 );
+    if( tmpFile == NULL ) return EPS_OUT_OF_MEMORY;
+    strcpy( tmpFile, OutFile );
+    strcat( tmpFile, ".tmp" );
+  }
+  if( io_open_input( InFile, y, o->Threads == 1 ) )
+  {
+    free( tmpFile );
+    return EPS_CANT_READ;
+  }
+  if( io_open_output( tmpFile != NULL ? tmpFile : OutFile, y ) )
+  {
+    io_close_input( y );
+    free( tmpFile );
+    return EPS_CANT_WRITE;
+  }
+  stats_io( y, t );
+  status = eps_compress( y, w, o );
+  
+  /* Close the files, once the staging buffer has been flushed (which is
+     timed by itself) */
+  io_flush( y );
+  t = stats_start( y );
+  if( io_close_output( y ) && status == EPS_OK ) status = EPS_WRITE_ERROR;
+  io_close_input( y );
+  if( tmpFile != NULL )
+  {
+    if( status == EPS_OK && io_replace_file( tmpFile, OutFile ) ) status = EPS_CANT_WRITE;
+    if( status != EPS_OK ) remove( tmpFile );
+    free( tmpFile );
+  }
+  stats_io( y, t );
+  *Bytes = y->OutTotal;
+  return status;
+}
+
+/**
+ *  A batch of files, each one compressed by a thread pool task.
+ */
+typedef struct{
+  char **InFiles;
+  char **OutFiles;
+  const EPS_Options *Options;
+  size_t *Bytes;
+  int *Status;
+} EPS_Batch;
+
+/**
+ *  Thread pool task compressing one file of a batch.
+ */
+static void eps_compress_batch( void *Context, size_t Index, Pool_Worker *w )
+{
+  EPS_Batch *b = (EPS_Batch *)Context;
+  
+  b->Status[ Index ] = eps_compress_file( b->InFiles[ Index ],
+    b->OutFiles[ Index ], &w->y, &w->Work, b->Options, &b->Bytes[ Index ], NULL );
+}
+
+EPS_Workspace *EPS_Workspace_Create( void )
+{
+  return (EPS_Workspace *)calloc( 1, sizeof( EPS_Workspace ) );
+}
+
+void EPS_Workspace_Destroy( EPS_Workspace *w )
+{
+  if( w == NULL ) return;
+  EPS_Workspace_Free( w );
+  free( w );
+}
+
+/**
+ *  Start gathering statistics, if asked for, returning the start time.
+ */
+static double stats_begin( EPS_Stats *Stats )
+{
+  if( Stats == NULL ) return 0;
+  memset( Stats, 0, sizeof( *Stats ) );
+  Stats->Hash = FNVOFFSET;
+  return eps_clock();
+}
+
+/**
+ *  Finish gathering statistics, with the total time since Start.
+ */
+static void stats_end( EPS_Stats *Stats, double Start )
+{
+  if( Stats != NULL ) Stats->TotalSeconds = eps_clock() - Start;
+}
+
+int EpsCompressMemory( const char *In, size_t InLength, char **Out,
+  size_t *OutLength, EPS_Workspace *w, const EPS_Options *o, EPS_Stats *Stats )
+{
+  IO_State y;
+  double t;
+  int status;
+  
+  t = stats_begin( Stats );
+  IO_State_Clear( &y );
+  y.InBuffer = In;
+  y.InLength = InLength;
+  y.Stats = Stats;
+  status = eps_compress( &y, w, o );
+  if( status != EPS_OK )
+  {
+    free( y.OutBuffer );
+    y.OutBuffer = NULL;
+    y.OutLength = 0;
+  }
+  *Out = y.OutBuffer;
+  *OutLength = y.OutLength;
+  stats_end( Stats, t );
+  return status;
+}
+
+int EpsCompressFile( const char *InFile, const char *OutFile,
+  EPS_Workspace *w, const EPS_Options *o, size_t *Bytes, EPS_Stats *Stats )
+{
+  IO_State y;
+  double t;
+  int status;
+  
+  t = stats_begin( Stats );
+  IO_State_Clear( &y );
+  status = eps_compress_file( InFile, OutFile, &y, w, o, Bytes, Stats );
+  free( y.OutBuffer );
+  stats_end( Stats, t );
+  return status;
+}
+
+int EpsCompressStream( FILE *In, FILE *Out, EPS_Workspace *w,
+  const EPS_Options *o, size_t *Bytes, EPS_Stats *Stats )
+{
+  IO_State y;
+  double t, io;
+  int status;
+  
+  t = stats_begin( Stats );
+  IO_State_Clear( &y );
+  y.Stats = Stats;
+  *Bytes = 0;
+  /* Serially, the input is streamed through a window, otherwise it all
+     needs to be read in first. */
+  io = stats_start( &y );
+  if( o->Threads == 1 ? io_stream_input( In, &y ) : io_read_stream( In, &y ) )
+    return ferror( In ) ? EPS_READ_ERROR : EPS_OUT_OF_MEMORY;
+  stats_io( &y, io );
+  y.OutBuffer = (char *)malloc( IOBLOCKSIZE );
+  if( y.OutBuffer == NULL )
+  {
+    y.fin = NULL;
+    io_close_input( &y );
+    return EPS_OUT_OF_MEMORY;
+  }
+  y.OutCapacity = IOBLOCKSIZE;
+  y.fout = Out;
+  status = eps_compress( &y, w, o );
+  io_flush( &y );
+  io = stats_start( &y );
+  if( fflush( Out ) != 0 ) y.WriteError = 1;
+  stats_io( &y, io );
+  if( y.WriteError && status == EPS_OK ) status = EPS_WRITE_ERROR;
+  /* The stream belongs to the caller, so only the window is released */
+  y.fin = NULL;
+  io_close_input( &y );
+  free( y.OutBuffer );
+  *Bytes = y.OutTotal;
+  stats_end( Stats, t );
+  return status;
+}
+
+void EpsCompressBatch( size_t n, char **InFiles, char **OutFiles,
+  const EPS_Options *o, int *Status, size_t *Bytes )
+{
+  EPS_Options fileOptions;
+  EPS_Batch batch;
+  
+  /* Each file is compressed serially, with the files spread over the
+     pool. */
+  fileOptions = *o;
+  fileOptions.Threads = 1;
+  batch.InFiles = InFiles;
+  batch.OutFiles = OutFiles;
+  batch.Options = &fileOptions;
+  batch.Bytes = Bytes;
+  batch.Status = Status;
+  Pool_Run( o->Threads, n, eps_compress_batch, &batch );
+}
+
+/* 
+ Copyright (c) 2010, Zebb Prime
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+     * Neither the name of the organisation nor the
+       names of its contributors may be used to endorse or promote products
+       derived from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL ZEBB PRIME BE LIABLE FOR ANY
+ DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
\ No newline at end of file
@@ -0,0 +1,194 @@
+/** \file epscompress_core.h
+ *
+ *  C interface to the EPS compressor used by the epscompress MEX
+ *  function and the epscompress command line tool.
+ *
+ *  Each segment of the EPS file between the DSC comments is compressed
+ *  with LZW (or Flate) and, by default, ASCII85 encoded, so that the file
+ *  remains a valid EPS file.
+ *
+ *  See the license at the bottom of the file.
+ */
+
+#ifndef EPSCOMPRESS_CORE_H
+#define EPSCOMPRESS_CORE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return values of the EpsCompress functions */
+#define EPS_OK 0
+#define EPS_NOT_EPS 1
+#define EPS_OUT_OF_MEMORY 2
+#define EPS_WRITE_ERROR 3
+#define EPS_CANT_READ 4
+#define EPS_CANT_WRITE 5
+#define EPS_READ_ERROR 6
+
+/* Compression methods */
+#define EPS_LZW 0
+#define EPS_FLATE 1
+
+/* Maximum number of threads used to compress a file */
+#define MAXTHREADS 64
+
+/* Largest factor images can be downsampled by */
+#define MAXDOWNSAMPLE 64
+
+/**
+ *  Options controlling the compression.
+ */
+typedef struct{
+  /* Number of threads to compress with. 1 compresses serially, and 0 uses
+     one thread per processor. */
+  int Threads;
+  /* Compression method, EPS_LZW or EPS_FLATE */
+  int Method;
+  /* Whether the compressed data is ASCII85 encoded, or left as binary */
+  int Ascii85;
+  /* Whether the LZW table is also cleared before it is full, when the
+     compression ratio drops, rather than only once it is full */
+  int AdaptiveReset;
+  /* Whether the hex encoded images (as Matlab writes the bitmaps of the
+     OpenGL and Z-buffer renderers) are re-encoded with the PNG predictor
+     and Flate, whatever the method. This needs a level 3 PostScript
+     interpreter. */
+  int Images;
+  /* Factor the re-encoded images are downsampled by in each direction,
+     averaging each block of samples, to make them smaller still. They
+     cover the same area of the page. 1 keeps them at full resolution. */
+  int Downsample;
+  /* Padding added to the left, bottom, right and top of the bounding box,
+     in points. The %%BoundingBox, %%HiResBoundingBox and
+     %%PageBoundingBox comments are rewritten as they are copied. */
+  int Pad[4];
+} EPS_Options;
+
+/**
+ *  Set the default options: serial, LZW, ASCII85 encoded, the table
+ *  cleared as soon as it is full, images left as they are (and at full
+ *  resolution), and no padding.
+ */
+void EPS_Options_Init( EPS_Options *o );
+
+/**
+ *  Statistics gathered while compressing, for finding out where the time
+ *  goes. Stage times are in seconds; with more than one thread they are
+ *  summed over the threads, so may add up to more than the total.
+ */
+typedef struct{
+  /* Characters read and written */
+  size_t BytesIn;
+  size_t BytesOut;
+  /* Number of compressed segments between the DSC comments */
+  size_t Segments;
+  /* Number of images re-encoded */
+  size_t Images;
+  /* Number of times the LZW table was cleared as it filled */
+  unsigned long long Resets;
+  /* Number of LZW dictionary lookups, and the table entries they looked
+     at past the first. The average search depth is 1 + Probes/Lookups. */
+  unsigned long long Lookups;
+  unsigned long long Probes;
+  /* Time spent scanning and compressing (LZW or Flate), ASCII85 encoding
+     (or packing the binary output), and reading and writing files */
+  double CompressSeconds;
+  double Ascii85Seconds;
+  double IoSeconds;
+  /* Wall clock time of the whole call */
+  double TotalSeconds;
+  /* 64-bit FNV-1a hash of the input, leaving out the date on the
+     %%CreationDate comment, for telling whether a file has changed */
+  unsigned long long Hash;
+} EPS_Stats;
+
+/**
+ *  The (large) compression states, which can be kept between calls to
+ *  save allocating them for every file. Anywhere a workspace is taken,
+ *  NULL may be given to use a temporary one instead. A workspace must
+ *  only be used by one call at a time.
+ */
+typedef struct EPS_Workspace EPS_Workspace;
+
+EPS_Workspace *EPS_Workspace_Create( void );
+void EPS_Workspace_Destroy( EPS_Workspace *w );
+
+/**
+ *  Error message for a non-zero return value of the EpsCompress
+ *  functions, or "" for EPS_OK.
+ */
+const char *EpsErrorMessage( int status );
+
+/**
+ *  Compress an EPS file held in memory. On success, *Out is set to a
+ *  malloc'd buffer of *OutLength characters, which the caller must free.
+ *  On failure, *Out is set to NULL. For this and the other single file
+ *  functions, statistics are gathered into Stats unless it is NULL.
+ */
+int EpsCompressMemory( const char *In, size_t InLength, char **Out,
+  size_t *OutLength, EPS_Workspace *w, const EPS_Options *o, EPS_Stats *Stats );
+
+/**
+ *  Compress the file InFile into OutFile, returning the number of
+ *  characters written in Bytes. The two may be the same file, in which
+ *  case the output is written to a temporary file beside it (OutFile with
+ *  ".tmp" appended) that then replaces it.
+ */
+int EpsCompressFile( const char *InFile, const char *OutFile,
+  EPS_Workspace *w, const EPS_Options *o, size_t *Bytes, EPS_Stats *Stats );
+
+/**
+ *  Compress from one open stream to another, e.g. stdin to stdout. Both
+ *  streams should be in binary mode, and are left open. Compressing
+ *  serially, the input is streamed in constant memory; with more threads
+ *  it is all read in first. The number of characters written is returned
+ *  in Bytes.
+ */
+int EpsCompressStream( FILE *In, FILE *Out, EPS_Workspace *w,
+  const EPS_Options *o, size_t *Bytes, EPS_Stats *Stats );
+
+/**
+ *  Compress a batch of n files, spread over o->Threads threads with each
+ *  file compressed serially. The status and number of characters written
+ *  for each file are returned in Status and Bytes. Failures don't stop
+ *  the rest of the batch.
+ */
+void EpsCompressBatch( size_t n, char **InFiles, char **OutFiles,
+  const EPS_Options *o, int *Status, size_t *Bytes );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/*
+ Copyright (c) 2010, Zebb Prime
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+     * Neither the name of the organisation nor the
+       names of its contributors may be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL ZEBB PRIME BE LIABLE FOR ANY
+ DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
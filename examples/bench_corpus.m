@@ -0,0 +1,90 @@
+%% Build the epscompress benchmark corpus.
+%  Exports a range of figure types, uncompressed, to the bench folder, for
+%  "make bench" to compress with each encoder mode:
+%    line      - small line plot
+%    scatter   - dense scatter plot
+%    text      - text heavy figure, in the style of the ex scripts
+%    opengl    - large OpenGL bitmap, combined with the painters text
+%    zbuffer   - large Z-buffer bitmap, combined with the painters text
+%    longlines - a few very long lines of hex image data, written directly,
+%                as some image EPS files have
+%  The random data is seeded, so the corpus is the same on every run.
+close all;
+addpath ..
+rand('twister',5489);
+randn('state',0);
+if ~exist('bench','dir')
+  mkdir('bench');
+end
+
+%% Small line plot
+hfig = figure;
+set(hfig,'units','centimeters','NumberTitle','off','Name','bench-line');
+pos = get(hfig,'position');
+set(hfig,'position',[pos(1:2),8,6]);
+plot(rand(10,3));
+xlabel('x');
+ylabel('y');
+matlabfrag('bench/line','compress',0);
+close(hfig);
+
+%% Dense scatter
+hfig = figure;
+set(hfig,'units','centimeters','NumberTitle','off','Name','bench-scatter');
+pos = get(hfig,'position');
+set(hfig,'position',[pos(1:2),8,6]);
+plot(randn(1e5,1),randn(1e5,1),'.','markersize',2);
+matlabfrag('bench/scatter','compress',0);
+close(hfig);
+
+%% Text heavy
+hfig = figure;
+set(hfig,'units','centimeters','NumberTitle','off','Name','bench-text');
+pos = get(hfig,'position');
+set(hfig,'position',[pos(1:2),12,12]);
+for ii=1:4
+  subplot(2,2,ii);
+  plot([-1e-3 1e-3],1e-3*rand(2,3));
+  title(sprintf('Subplot %i',ii));
+  xlabel('time ($\mu$s)','userdata','matlabfrag:time ($\mu$s)');
+  ylabel('amplitude');
+  legend('first','second','third');
+  text(0,0.5e-3,'$\alpha+\beta$','interpreter','latex',...
+    'userdata','matlabfrag:$\alpha+\beta$');
+end
+matlabfrag('bench/text','compress',0);
+close(hfig);
+
+%% OpenGL and Z-buffer bitmaps
+renderers = {'opengl','zbuffer'};
+for ii=1:length(renderers)
+  hfig = figure;
+  set(hfig,'units','centimeters','NumberTitle','off',...
+    'Name',['bench-',renderers{ii}]);
+  pos = get(hfig,'position');
+  set(hfig,'position',[pos(1:2),8,6]);
+  surf(peaks(100));
+  shading interp;
+  xlabel('X');
+  ylabel('Y');
+  zlabel('Z');
+  matlabfrag(['bench/',renderers{ii}],'renderer',renderers{ii},...
+    'dpi',720,'compress',0);
+  close(hfig);
+end
+
+%% A few very long lines of hex image data
+% Five rows of a 75000 sample greyscale image, one 150000 character line
+% each, between the DSC comments. Fewer lines than epscompress looks ahead
+% for, but long enough that they should still be compressed.
+fh = fopen('bench/longlines.eps','w');
+fprintf(fh,'%%!PS-Adobe-3.0 EPSF-3.0\n%%%%BoundingBox: 0 0 300 20\n%%%%EndComments\n');
+fprintf(fh,'gsave\n300 20 scale\n75000 5 8 [75000 0 0 -5 0 5]\n');
+fprintf(fh,'{currentfile 75000 string readhexstring pop} image\n');
+row = floor(255*(0.5+0.5*sin((1:75000)/500)));
+for ii=1:5
+  fprintf(fh,'%02x',mod(row+16*ii,256));
+  fprintf(fh,'\n');
+end
+fprintf(fh,'grestore\n%%%%EOF\n');
+fclose(fh);
@@ -0,0 +1,400 @@
+/** \file filewait.c
+ *
+ *  Waits for a file to be written, for matlabfrag,
+ *    Found = filewait( FileName, Timeout )
+ *  Returns true as soon as the file exists and has been written, or false
+ *  if it still doesn't exist after Timeout seconds (default 5). A file
+ *  that exists but is still being written when the time runs out counts
+ *  as found.
+ *
+ *  Rather than polling, this waits on changes to the file's folder: with
+ *  inotify on Linux, and a change notification on Windows. Elsewhere, the
+ *  file is polled for with a delay that starts at 1 ms and backs off to
+ *  50 ms. How a file is known to have been written depends on the
+ *  platform:
+ *    Linux   - it has been closed after writing (or moved into place), or
+ *              for a file that was already there, a read lease can be
+ *              taken on it, so nothing has it open for writing.
+ *    Windows - it can be opened for exclusive access, so nothing else has
+ *              it open.
+ *    Others  - its size and modification time are the same between two
+ *              looks STABLEDELAY apart. This is also the fallback on
+ *              Linux where leases can't be taken, such as on network
+ *              drives.
+ *  Compile with
+ *    mex filewait.c
+ *
+ *  See the license at the bottom of the file.
+ */
+
+/* clock_gettime and nanosleep are POSIX, and file leases are Linux
+   specific, so need asking for in a strict C compile */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+#include "mex.h"
+
+/* Default time to wait for, in seconds */
+#define DEFAULTTIMEOUT 5.0
+/* Polling delays, in seconds */
+#define MINDELAY 0.001
+#define MAXDELAY 0.05
+/* Time between two looks at a file that has to be unchanged for it to
+   count as written, in seconds, where nothing better can be told */
+#define STABLEDELAY 0.02
+
+/**
+ *  Test whether a file exists.
+ */
+static int file_exists( const char *filename )
+{
+#ifdef _WIN32
+  return GetFileAttributesA( filename ) != INVALID_FILE_ATTRIBUTES;
+#else
+  struct stat sb;
+
+  return stat( filename, &sb ) == 0;
+#endif
+}
+
+/**
+ *  Monotonic clock, in seconds.
+ */
+static double wait_clock( void )
+{
+#ifdef _WIN32
+  return GetTickCount64()*1e-3;
+#else
+  struct timespec t;
+
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec + 1e-9*t.tv_nsec;
+#endif
+}
+
+/**
+ *  Sleep for a delay, in seconds.
+ */
+static void wait_sleep( double delay )
+{
+#ifdef _WIN32
+  Sleep( (DWORD)( delay*1e3 ) );
+#else
+  struct timespec t;
+
+  t.tv_sec = (time_t)delay;
+  t.tv_nsec = (long)( ( delay - (double)t.tv_sec )*1e9 );
+  nanosleep( &t, NULL );
+#endif
+}
+
+#ifndef _WIN32
+/**
+ *  Wait, until Timeout seconds after Start, for the size and modification
+ *  time of a file to be the same between two looks STABLEDELAY apart.
+ *  The modification time is only compared with itself, never with the
+ *  local clock, which a file server's can be well out from.
+ */
+static void stable_file( const char *filename, double Start, double Timeout )
+{
+  struct stat sb;
+  off_t size;
+  time_t mtime;
+
+  if( stat( filename, &sb ) != 0 ) return;
+  do
+  {
+    size = sb.st_size;
+    mtime = sb.st_mtime;
+    if( wait_clock() - Start >= Timeout ) return;
+    wait_sleep( STABLEDELAY );
+    if( stat( filename, &sb ) != 0 ) return;
+  } while( sb.st_size != size || sb.st_mtime != mtime );
+}
+#endif
+
+/**
+ *  Wait, until Timeout seconds after Start, for a file that exists to
+ *  have been written: on Linux until a read lease can be taken on it, on
+ *  Windows until it can be opened for exclusive access, and elsewhere
+ *  until it is stable. On Linux and Windows, a file that nothing is
+ *  writing returns straight away.
+ */
+static void settle_file( const char *filename, double Start, double Timeout )
+{
+#if defined(__linux__)
+  double delay = MINDELAY;
+  int fd, lease, error;
+
+  for(;;)
+  {
+    fd = open( filename, O_RDONLY );
+    if( fd < 0 ) return;
+    /* A read lease can't be had while anything has the file open for
+       writing */
+    lease = fcntl( fd, F_SETLEASE, F_RDLCK );
+    error = errno;
+    if( lease == 0 ) fcntl( fd, F_SETLEASE, F_UNLCK );
+    close( fd );
+    if( lease == 0 ) return;
+    /* Leases aren't supported on network drives, nor for files owned by
+       someone else */
+    if( error != EAGAIN )
+    {
+      stable_file( filename, Start, Timeout );
+      return;
+    }
+    if( wait_clock() - Start >= Timeout ) return;
+    wait_sleep( delay );
+    delay = 2*delay > MAXDELAY ? MAXDELAY : 2*delay;
+  }
+#elif defined(_WIN32)
+  HANDLE h;
+  double delay = MINDELAY;
+
+  for(;;)
+  {
+    h = CreateFileA( filename, GENERIC_READ, 0, NULL, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, NULL );
+    if( h != INVALID_HANDLE_VALUE )
+    {
+      CloseHandle( h );
+      return;
+    }
+    /* Any other failure can't be waited out */
+    if( GetLastError() != ERROR_SHARING_VIOLATION ) return;
+    if( wait_clock() - Start >= Timeout ) return;
+    wait_sleep( delay );
+    delay = 2*delay > MAXDELAY ? MAXDELAY : 2*delay;
+  }
+#else
+  stable_file( filename, Start, Timeout );
+#endif
+}
+
+/**
+ *  Split a file name into its folder (into the buffer Folder, of length
+ *  n) and its name, which is returned.
+ */
+static const char *split_path( const char *filename, char *Folder, size_t n )
+{
+  const char *name = filename, *p;
+  size_t length;
+
+  for( p=filename; *p != '\0'; p++ )
+  {
+    if( *p == '/' ) name = p+1;
+#ifdef _WIN32
+    if( *p == '\\' || *p == ':' ) name = p+1;
+#endif
+  }
+  length = (size_t)( name-filename );
+  if( length == 0 )
+  {
+    strcpy( Folder, "." );
+    return name;
+  }
+  if( length >= n ) length = n-1;
+  memcpy( Folder, filename, length );
+  Folder[ length ] = '\0';
+  return name;
+}
+
+/**
+ *  Poll for the file, backing off from MINDELAY to MAXDELAY between
+ *  checks. Used where the folder can't be watched.
+ */
+static int poll_file( const char *filename, double Timeout )
+{
+  double start = wait_clock(), delay = MINDELAY;
+
+  for(;;)
+  {
+    if( file_exists( filename ) ) break;
+    if( wait_clock() - start >= Timeout ) return 0;
+    wait_sleep( delay );
+    delay = 2*delay > MAXDELAY ? MAXDELAY : 2*delay;
+  }
+  settle_file( filename, start, Timeout );
+  return 1;
+}
+
+/**
+ *  Wait for the file to exist, for up to Timeout seconds. Returns
+ *  non-zero if it does.
+ */
+static int wait_file( const char *filename, double Timeout )
+{
+#if defined(__linux__)
+  struct pollfd pfd;
+  union{
+    struct inotify_event Event;
+    char Bytes[ 4096 ];
+  } events;
+  char *folder;
+  const struct inotify_event *event;
+  const char *name;
+  double start, remaining;
+  ssize_t n, ii;
+  int fd, found = 0;
+
+  /* print returns once the file is written, so it is usually there
+     already, and setting up a watch would only cost time */
+  if( file_exists( filename ) )
+  {
+    settle_file( filename, wait_clock(), Timeout );
+    return 1;
+  }
+  folder = (char *)malloc( strlen( filename )+2 );
+  if( folder == NULL ) return poll_file( filename, Timeout );
+  name = split_path( filename, folder, strlen( filename )+2 );
+  fd = inotify_init();
+  if( fd < 0 || inotify_add_watch( fd, folder, IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 )
+  {
+    if( fd >= 0 ) close( fd );
+    free( folder );
+    return poll_file( filename, Timeout );
+  }
+  free( folder );
+
+  /* Only check once the watch is in place, so that the file can't be
+     closed in between unnoticed. */
+  start = wait_clock();
+  if( file_exists( filename ) )
+  {
+    /* It may have been closed before the watch, so no event will come */
+    close( fd );
+    settle_file( filename, start, Timeout );
+    return 1;
+  }
+  while( !found )
+  {
+    remaining = Timeout - ( wait_clock() - start );
+    if( remaining <= 0 ) break;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if( poll( &pfd, 1, (int)( remaining*1e3 ) + 1 ) < 0 )
+    {
+      if( errno == EINTR ) continue;
+      break;
+    }
+    if( !( pfd.revents & POLLIN ) ) continue;
+    n = read( fd, events.Bytes, sizeof( events ) );
+    for( ii=0; ii + (ssize_t)sizeof( struct inotify_event ) <= n;
+         ii += sizeof( struct inotify_event ) + event->len )
+    {
+      event = (const struct inotify_event *)( events.Bytes + ii );
+      if( event->len > 0 && strcmp( event->name, name ) == 0 ) found = 1;
+    }
+  }
+  close( fd );
+  /* A timeout still counts if the file turned up without an event */
+  return found || file_exists( filename );
+#elif defined(_WIN32)
+  HANDLE h;
+  char *folder;
+  double start, remaining;
+  int found;
+
+  if( file_exists( filename ) )
+  {
+    settle_file( filename, wait_clock(), Timeout );
+    return 1;
+  }
+  folder = (char *)malloc( strlen( filename )+2 );
+  if( folder == NULL ) return poll_file( filename, Timeout );
+  split_path( filename, folder, strlen( filename )+2 );
+  h = FindFirstChangeNotificationA( folder, FALSE,
+    FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE );
+  free( folder );
+  if( h == INVALID_HANDLE_VALUE ) return poll_file( filename, Timeout );
+
+  start = wait_clock();
+  found = file_exists( filename );
+  while( !found )
+  {
+    remaining = Timeout - ( wait_clock() - start );
+    if( remaining <= 0 ) break;
+    if( WaitForSingleObject( h, (DWORD)( remaining*1e3 ) + 1 ) != WAIT_OBJECT_0 ) break;
+    found = file_exists( filename );
+    if( !FindNextChangeNotification( h ) ) break;
+  }
+  FindCloseChangeNotification( h );
+  if( !found && !file_exists( filename ) ) return 0;
+  settle_file( filename, start, Timeout );
+  return 1;
+#else
+  return poll_file( filename, Timeout );
+#endif
+}
+
+/**
+ *  Main function call in a c-mex environment.
+ */
+void mexFunction(int nlhs,mxArray *plhs[],int nrhs,const mxArray *prhs[])
+{
+  char *filename;
+  double timeout = DEFAULTTIMEOUT;
+  int found;
+
+  if( nrhs < 1 || nrhs > 2 ) mexErrMsgTxt("One or two input arguments required.\n");
+  if( nlhs > 1 ) mexErrMsgTxt("Too many output arguments.\n");
+  if( !mxIsChar( prhs[0] ) ) mexErrMsgTxt("Input (filename) must be of type string.\n");
+  if( nrhs == 2 )
+  {
+    if( !mxIsNumeric( prhs[1] ) || mxGetNumberOfElements( prhs[1] ) != 1 )
+      mexErrMsgTxt("The timeout must be a scalar.\n");
+    timeout = mxGetScalar( prhs[1] );
+  }
+
+  filename = mxArrayToString( prhs[0] );
+  found = wait_file( filename, timeout );
+  mxFree( filename );
+  plhs[0] = mxCreateLogicalScalar( found != 0 );
+}
+
+/*
+ Copyright (c) 2010, Zebb Prime
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+     * Neither the name of the organisation nor the
+       names of its contributors may be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL ZEBB PRIME BE LIABLE FOR ANY
+ DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
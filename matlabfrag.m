@@ -1,4 +1,4 @@
-% function matlabfrag(FileName,OPTIONS)
+% function [Job,Timing] = matlabfrag(FileName,OPTIONS)
 %  Exports a matlab figure to an .eps file and a .tex file for use with
 %  psfrag in LaTeX.  It provides similar functionality to Laprint, but
 %  with an emphasis on making it more WYSIWYG, and respecting the handle
@@ -27,10 +27,77 @@
 %                  |  matlabfrag will use this value.
 %    'dpi'         | DPI to print the images at. Default is 300 for OpenGL
 %                  |  or Z-Buffer images, and 3200 for painters images.
-%    'compress'    | [0|1|true|false] - whether to compress the resulting
-%                  |   eps file or not. Default is true (compression on).
+%    'compress'    | [0|1|true|false|'lzw'|'flate'] - whether to compress
+%                  |   the resulting eps file or not, and how. true is the
+%                  |   same as 'lzw'. 'flate' gives smaller files, and also
+%                  |   re-encodes OpenGL and Z-buffer bitmaps with a PNG
+%                  |   predictor, but needs a level 3 PostScript
+%                  |   interpreter. Default is true.
+%    'epsbudget'   | Size budget for the compressed eps file, in bytes. If
+%                  |   the file is bigger, its OpenGL or Z-buffer bitmap is
+%                  |   downsampled by 2, 4, ... until it fits, rather than
+%                  |   printing the figure again at a lower 'dpi'. The
+%                  |   bitmap is then re-encoded as for 'flate', so needs a
+%                  |   level 3 PostScript interpreter. This compresses in
+%                  |   the foreground, even with 'async'. If the budget
+%                  |   can't be met, or the file isn't compressed, the
+%                  |   warning matlabfrag:epsbudget:NotMet is given.
+%                  |   Default is Inf.
 %    'unaryminus'  | ['normal'|'short'] - whether to use a short or normal
 %                  |   unary minus sign on tick labels. Default is 'normal'.
+%    'textpass'    | ['full'|'textonly'] - how the painters copy of an
+%                  |   OpenGL or Z-buffer figure, which only the text is
+%                  |   taken from, is printed. 'textonly' hides the lines,
+%                  |   surfaces, patches and images first, which is much
+%                  |   quicker for large plots. Default is 'full'.
+%    'async'       | [true|false] - whether to compress (and pad) the eps
+%                  |   file in the background, returning as soon as the
+%                  |   figure has been restored. Default is false.
+%    'incremental' | [true|false] - whether to leave the .eps and .tex
+%                  |   files untouched if the figure hasn't changed since
+%                  |   they were written, so that LaTeX has nothing to
+%                  |   rebuild. The figure is still printed, and compared
+%                  |   by a hash kept in a FileName.hash file. This
+%                  |   compresses in the foreground, even with 'async'.
+%                  |   Default is false.
+%
+% Several figures can be exported in one call, sharing the options,
+%  matlabfrag({FileName1,FileName2,...},'handle',[h1,h2,...],OPTIONS)
+% The session setup (the version check, .tex header and option parser) is
+% only done once, and the figures are compressed together at the end,
+% spread over the processors. As with a single figure, a figure without
+% text is printed as is, and not padded or compressed.
+%
+% With 'async', the compression job number is returned as Job (for a
+% batch, one for each eps file written). To wait for the jobs to finish,
+% giving any failures as warnings, run
+%  matlabfrag('-wait')
+% or follow them with
+%  [Bytes,Messages] = matlabfrag('-status',Job)
+% which returns the size of each compressed file (NaN if not finished yet,
+% -1 if it failed), and the error messages. Exporting to a file waits for
+% any job still compressing it. A file whose job fails is left as printed,
+% uncompressed and unpadded.
+%
+% The wall time of each stage of the export, in seconds, is returned in
+% the struct Timing (for a batch, one for each figure), with the fields
+%  Legends, Ticks, Text - processing the legends, axes and text objects
+%  Actions              - applying the property changes before printing
+%  Print                - each print, one element per print
+%  FileWait             - waiting for the printed files to appear
+%  Combine              - the rest of combining an OpenGL or Z-buffer
+%                         print with its painters text
+%  Pad, Compress        - padding and compressing the eps file (with
+%                         'async', queueing it; for a batch compressed
+%                         together at the end, the time of that one call)
+%  UndoActions          - restoring the figure
+%  Tex                  - writing the .tex file
+%  Total                - the whole call
+% With a 'debuglvl' of 1 or more, this is reported as it is exported too.
+%
+% Converted text is cached for the rest of the session, so that labels
+% repeated across figures are only escaped once. To clear the cache, run
+%  matlabfrag('-clearcache')
 %
 % EXAMPLE
 % plot(1:10,rand(1,10));
@@ -46,7 +113,8 @@
 %
 % Released on the <a href="matlab:web('http://www.mathworks.com/matlabcentral/fileexchange/21286','-browser')">Matlab File Exchange</a>
 
-function matlabfrag(FileName,varargin)
+function varargout = matlabfrag(FileName,varargin)
+varargout = cell(1,nargout);
 
 % Nice output if the user calls matlabfrag without any parameters.
 if nargin == 0
@@ -54,26 +122,35 @@ if nargin == 0
   return;
 end
 
-% Matlab version check
-v = version;
-v = regexp(v,'(\d+)\.(\d+)\.\d+\.\d+','tokens');
-v = str2double(v{1});
-if v(1) < 7
-  error('matlabfrag:oldMatlab','Matlabfrag requires Matlab r2007a or newer to run');
-elseif v(1) == 7
-  if v(2) < 4
-    error('matlabfrag:oldMatlab','Matlabfrag requires Matlab r2007a or newer to run');
+if nargin == 1 && ischar(FileName) && strcmpi(FileName,'-clearcache')
+  LatexCache('clear');
+  return;
+end
+
+% Background compression queue commands
+if ischar(FileName) && any( strcmpi(FileName,{'-wait','-status'}) )
+  if QueuedJobs()
+    [varargout{1:nargout}] = epscompress(FileName,varargin{:});
+  elseif strcmpi(FileName,'-status') && nargout > 0
+    % Nothing can have been queued
+    varargout{1} = 0;
   end
+  return;
 end
 
-% Version information is taken from the above help information
-HelpText = help('matlabfrag');
-LatestVersion = regexp(HelpText,'(v[\d\.]+\w*?) ([\d]+\-[\w]+\-[\d]+)','tokens');
-LatestVersion = LatestVersion{1};
-Version = LatestVersion{1};
-VersionDate = LatestVersion{2};
-TEXHDR = sprintf('%% Generated using matlabfrag\n%% Version: %s\n%% Version Date: %s\n%% Author: Zebb Prime',...
-  Version,VersionDate);
+if iscell(FileName)
+  [Job,Timing] = BatchExport(FileName,varargin{:});
+  if nargout > 0
+    varargout{1} = Job;
+  end
+  if nargout > 1
+    varargout{2} = Timing;
+  end
+  return;
+end
+
+% Matlab version check, and the .tex file header
+[v,TEXHDR] = SessionInfo();
 
 % Global macros
 REPLACEMENT_FORMAT = '%03d';
@@ -81,29 +158,30 @@ USERDATA_PREFIX = 'matlabfrag:';
 NEGTICK_SHORT_COMMAND = 'matlabfragNegTickShort';
 NEGTICK_SHORT_SCRIPT_COMMAND = 'matlabfragNegTickShortScript';
 NEGTICK_NO_WIDTH_COMMAND = 'matlabfragNegTickNoWidth';
-ACTION_FUNC_NAME = @(x) sprintf('f%i',x);
-ACTION_DESC_NAME = @(x) sprintf('d%i',x);
+QUEUE_CAPACITY = 64;
 
 % Debug macro levels
 KEEP_TEMPFILE = 1;
 SHOW_OPTIONS = 1;
+SHOW_COMPRESS_STATS = 1;
 PAUSE_BEFORE_PRINT = 2;
 PAUSE_AFTER_PRINT = 2;
 STEP_THROUGH_ACTIONS = 3;
+SHOW_TIMING = 1;
 
-p = inputParser;
-p.FunctionName = 'matlabfrag';
-
-p.addRequired('FileName', @(x) ischar(x) );
-p.addParameter('handle', gcf, @(x) ishandle(x) && strcmpi(get(x,'Type'),'figure') );
-p.addParameter('epspad', [0,0,0,0], @(x) isnumeric(x) && (all(size(x) == [1 4])) );
-p.addParameter('renderer', 'painters', ...
-  @(x) any( strcmpi(x,{'painters','opengl','zbuffer'}) ) );
-p.addParameter('dpi', 300, @(x) isnumeric(x) );
-p.addParameter('compress',1, @(x) (isnumeric(x) || islogical(x) ) );
-p.addParameter('debuglvl',0, @(x) isnumeric(x) && x>=0);
-p.addParameter('unaryminus','normal', @(x) any( strcmpi(x,{'short','normal'}) ) );
+p = OptionParser();
 p.parse(FileName,varargin{:});
+% The parser is kept for the session, so the current figure can't be its
+% default handle, as that is bound when the parser is built
+if isempty(p.Results.handle)
+  p.parse(FileName,varargin{:},'handle',gcf);
+end
+
+% Wall time of each stage, in seconds
+TotalTimer = tic;
+Timing = struct('Legends',0,'Ticks',0,'Text',0,'Actions',0,...
+  'Print',zeros(1,0),'FileWait',0,'Combine',0,'Pad',0,'Compress',0,...
+  'UndoActions',0,'Tex',0,'Total',0);
 
 if p.Results.debuglvl >= SHOW_OPTIONS
   fprintf(1,'OPTION: FileName = %s\n',p.Results.FileName);
@@ -112,14 +190,31 @@ if p.Results.debuglvl >= SHOW_OPTIONS
   fprintf(1,'OPTION: renderer = %s\n',p.Results.renderer);
   fprintf(1,'OPTION: dpi = %i\n',p.Results.dpi);
   fprintf(1,'OPTION: debuglvl = %i\n',p.Results.debuglvl);
-  fprintf(1,'OPTION: compress = %i\n',p.Results.compress);
+  if ischar(p.Results.compress)
+    fprintf(1,'OPTION: compress = %s\n',p.Results.compress);
+  else
+    fprintf(1,'OPTION: compress = %i\n',p.Results.compress);
+  end
   fprintf(1,'OPTION: unaryminus = %s\n',p.Results.unaryminus);
+  fprintf(1,'OPTION: textpass = %s\n',p.Results.textpass);
+  fprintf(1,'OPTION: async = %i\n',p.Results.async);
+  fprintf(1,'OPTION: incremental = %i\n',p.Results.incremental);
+  fprintf(1,'OPTION: epsbudget = %g\n',p.Results.epsbudget);
   fprintf(1,'OPTION: Parameters using their defaults:');
   fprintf(1,' %s',p.UsingDefaults{:});
   fprintf(1,'\n');
 end
 
+% The third output, only used by BatchExport, is whether the figure was
+% exported with its text, rather than just printed
 if FigureHasNoText(p)
+  Timing.Total = toc(TotalTimer);
+  if nargout > 1
+    varargout{2} = Timing;
+  end
+  if nargout > 2
+    varargout{3} = false;
+  end
   return;
 end
 
@@ -133,17 +228,22 @@ else
   writeOutNegTickNoWidth = @(fid) fprintf(fid,'\n\\providecommand\\%s{\\makebox[0pt][r]{\\ensuremath{-}}}%%',NEGTICK_NO_WIDTH_COMMAND);
 end
 
-% Create Action and UndoAction structures, and initialise the length field
-% to 0.
+% Create the Action and UndoAction queues. Each action is either a
+% function, or a property change {handle,Props,PropVals}. The cells are
+% grown by doubling their capacity, with length the number in use.
 Actions.length = 0;
-UndoActions.length = 0;
+Actions.Action = cell(1,QUEUE_CAPACITY);
+Actions.Description = cell(1,QUEUE_CAPACITY);
+UndoActions = Actions;
 StringCounter = 0;
 
 % PsfragCmds are currently in the order:
 % {LatexString, ReplacementString, Alignment, TextSize, Colour,
 %   FontAngle (1-italic,0-normal), FontWeight (1-bold,0-normal),
 %   FixedWidth (1-true,0-false), LabelType }
-PsfragCmds = {};
+% The first NumPsfragCmds rows are in use.
+PsfragCmds = cell(QUEUE_CAPACITY,9);
+NumPsfragCmds = 0;
 
 % Before doing anthing to the figure, make sure it is fully drawn
 drawnow;
@@ -160,19 +260,19 @@ SetUnsetProperties('PaperUnits to cm, PaperPos to Pos',p.Results.handle,...
 ProcessFigure(p.Results.handle);
 
 % Apply the actions resulting from the processing
+Timer = tic;
 if p.Results.debuglvl >= STEP_THROUGH_ACTIONS
   disp('STEPPING: Starting to apply actions');
   for ii=1:Actions.length
-    fprintf(1,'STEPPING: Press space to apply: %s\n',Actions.( ACTION_DESC_NAME(ii) ));
+    fprintf(1,'STEPPING: Press space to apply: %s\n',Actions.Description{ii});
     pause;
-    Actions.( ACTION_FUNC_NAME(ii) )();
+    ApplyActions(Actions,ii);
   end
   disp('STEPPING: Finished applying actions');
 else
-  for ii=1:Actions.length
-    Actions.( ACTION_FUNC_NAME(ii) )();
-  end
+  ApplyActions(Actions,1:Actions.length);
 end
+Timing.Actions = toc(Timer);
 
 if p.Results.debuglvl >= PAUSE_BEFORE_PRINT
   disp('PAUSING: Paused before printing');
@@ -198,6 +298,25 @@ else
   FileName = namestr;
 end
 
+% Don't print over an eps file that is still being compressed. Only a
+% session that has queued jobs can have one, and only a compiled
+% epscompress with the queue knows the '-wait' command.
+if QueuedJobs()
+  try
+    epscompress('-wait',[FileName,'.eps']);
+  catch
+    warning(['Waiting for the compression of ',FileName,'.eps',' failed!'])
+  end
+end
+
+% In incremental mode, the files are written beside the existing ones
+% first, then only moved into place if they have changed
+Incremental = p.Results.incremental;
+if Incremental
+  OutName = FileName;
+  FileName = [FileName,'-new'];
+end
+
 dpiswitch = ['-r',num2str( round( p.Results.dpi ) )];
 % Unless over-ridden, check to see if 'renderermode' is 'manual'
 renderer = lower( p.Results.renderer );
@@ -246,12 +365,16 @@ if strcmpi(renderer,'painters')
 
   % Export the image to an eps file
   drawnow;
+  Timer = tic;
   print(p.Results.handle,'-depsc2','-loose',dpiswitch,'-painters',FileName);
+  Timing.Print(end+1) = toc(Timer);
   FileWait( [FileName,'.eps'] );
 else
   % If using the opengl or zbuffer renderer
+  Timer = tic;
   EpsCombine(p.Results.handle,renderer,FileName,dpiswitch,...
-    p.Results.debuglvl>=KEEP_TEMPFILE)
+    p.Results.debuglvl>=KEEP_TEMPFILE,strcmpi(p.Results.textpass,'textonly'))
+  Timing.Combine = toc(Timer) - sum(Timing.Print) - Timing.FileWait;
 end
 
 if p.Results.debuglvl >= PAUSE_AFTER_PRINT
@@ -259,97 +382,157 @@ if p.Results.debuglvl >= PAUSE_AFTER_PRINT
   pause;
 end
 
-% Pad the eps if requested
-if any( p.Results.epspad )
-  fh = fopen([FileName,'.eps'],'r');
-  epsfile = fread(fh,inf,'uint8=>char').';
-  fclose(fh);
-  bb = regexpi(epsfile,'\%\%BoundingBox:\s+(-*\d+)\s+(-*\d+)\s+(-*\d+)\s+(-*\d+)','tokens');
-  bb = str2double(bb{1});
-  epsfile = regexprep(epsfile,sprintf('%i(\\s+)%i(\\s+)%i(\\s+)%i',bb),...
-    sprintf('%i$1%i$2%i$3%i',bb+round(p.Results.epspad.*[-1,-1,1,1])));
-  fh = fopen([FileName,'.eps'],'w');
-  fwrite(fh,epsfile);
-  fclose(fh);
+% Check that epscompress is available if compression is requested
+CompressEps = p.Results.compress;
+CompressMethod = 'lzw';
+if ischar(CompressEps)
+  CompressMethod = lower(CompressEps);
+  CompressEps = 1;
+end
+% Compression is on by default, so this is warned of even if 'compress'
+% wasn't given
+if CompressEps && exist('epscompress','file') ~= 3
+  warning('matlabfrag:epscompress:NotFound',...
+    ['Cannot find a compiled version of epscompress, thus the eps\n',...
+    'file will not be compressed. To compile epscompress, in Matlab\n',...
+    'navigate to the matlabfrag folder and run:\n',...
+    '  >> mex -setup %% If mex hasn''t been setup before\n',...
+    '  >> mex epscompress.c epscompress_core.c\n\n',...
+    'Suppress this warning in the future by running:\n',...
+    '  >> warning off matlabfrag:epscompress:NotFound\n',...
+    'or turning the ''compress'' option off.']);
+  CompressEps = 0;
 end
 
-% Compress the eps if requested
-if p.Results.compress
-  if exist('epscompress','file') ~= 3
-    if ~any( strcmpi(p.UsingDefaults,'compress') )
-      warning('matlabfrag:epscompress:NotFound',...
-        ['Cannot find a compiled version of epscompress, thus the eps\n',...
-        'file will not be compressed. To compile epscompress, in Matlab\n',...
-        'navigate to the matlabfrag folder and run:\n',...
-        '  >> mex -setup %% If mex hasn''t been setup before\n',...
-        '  >> mex epscompress.c\n\n',...
-        'Suppress this warning in the future by running:\n',...
-        '  >> warning off matlabfrag:epscompress:NotFound\n',...
-        'or turning the ''compress'' option off.']);
+% Pad and compress the eps if requested. epscompress pads the bounding
+% box as it streams the file, compressing it in place; the padding is only
+% done here if the file isn't compressed. With async, the file is queued
+% to be compressed in the background instead. Incrementally, the hash of
+% the printed file, with the compression options, is the key it is
+% compared by.
+PadEps = any( p.Results.epspad );
+Budget = p.Results.epsbudget;
+Job = [];
+EpsKey = '';
+Timer = tic;
+if CompressEps
+  try
+    if p.Results.async && ~Incremental && isinf(Budget)
+      Job = epscompress([FileName,'.eps'],[FileName,'.eps'],...
+        'method',CompressMethod,'images',strcmp(CompressMethod,'flate'),...
+        'epspad',p.Results.epspad,'async',true);
+      QueuedJobs(true);
+      if p.Results.debuglvl >= SHOW_COMPRESS_STATS
+        fprintf(1,'COMPRESS: %s.eps: queued as job %i\n',FileName,Job);
+      end
+    elseif p.Results.debuglvl >= SHOW_COMPRESS_STATS || Incremental
+      [bytes,stats,Downsample] = CompressEpsFile(FileName,CompressMethod,...
+        p.Results.epspad,Budget);
+      EpsKey = sprintf('%s %s %i %i %i %i',stats.Hash,CompressMethod,...
+        round(p.Results.epspad));
+      if ~isinf(Budget)
+        EpsKey = sprintf('%s %g',EpsKey,Budget);
+      end
+      if p.Results.debuglvl >= SHOW_COMPRESS_STATS
+        if Downsample > 1
+          fprintf(1,'COMPRESS: %s.eps: bitmap downsampled by %i to fit the budget\n',...
+            FileName,Downsample);
+        end
+        fprintf(1,['COMPRESS: %s.eps: %i -> %i bytes, %i segments, %i images, ',...
+          '%i table resets, search depth %.2f\n'],FileName,stats.BytesIn,bytes,...
+          stats.Segments,stats.Images,stats.Resets,stats.SearchDepth);
+        fprintf(1,['COMPRESS: %s.eps: %.3f s total: %.3f s compress, %.3f s ASCII85, ',...
+          '%.3f s IO\n'],FileName,stats.TotalTime,stats.CompressTime,...
+          stats.Ascii85Time,stats.IoTime);
+      end
+    else
+      CompressEpsFile(FileName,CompressMethod,p.Results.epspad,Budget);
+    end
+    PadEps = 0;
+  catch
+    % An older compiled epscompress only takes the two file names, and
+    % doesn't pad, so the padding is done first, while the file is text
+    if PadEps
+      PadEpsFile([FileName,'.eps'],p.Results.epspad);
+      PadEps = 0;
     end
-  else
     try
-        movefile([FileName,'.eps'],[FileName,'-uncompressed.eps']);
-        epscompress([FileName,'-uncompressed.eps'],[FileName,'.eps']);
-        delete([FileName,'-uncompressed.eps']);
+      PlainCompressEpsFile([FileName,'.eps']);
     catch
-        warning(['epscompress of ',FileName,'-uncompressed.eps',' failed!'])
+      warning(['epscompress of ',FileName,'.eps',' failed!'])
     end
   end
 end
+Timing.Compress = toc(Timer);
+if PadEps
+  Timer = tic;
+  PadEpsFile([FileName,'.eps'],p.Results.epspad);
+  Timing.Pad = toc(Timer);
+end
+
+% Say if the size budget wasn't met, either because the file couldn't be
+% shrunk enough (it has no bitmaps, or they are already downsampled by
+% 64), or because it couldn't be compressed to it at all
+if ~isinf(Budget)
+  BudgetName = [FileName,'.eps'];
+  if Incremental
+    BudgetName = [OutName,'.eps'];
+  end
+  EpsInfo = dir([FileName,'.eps']);
+  if ~CompressEps
+    warning('matlabfrag:epsbudget:NotMet',...
+      'The ''epsbudget'' of %s can''t be applied, as it isn''t compressed.',...
+      BudgetName);
+  elseif ~isempty(EpsInfo) && EpsInfo.bytes > Budget
+    warning('matlabfrag:epsbudget:NotMet',...
+      '%s is %i bytes, over its ''epsbudget'' of %g bytes.',...
+      BudgetName,EpsInfo.bytes,Budget);
+  end
+end
 
 % Apply the undo action to restore the image to how
 %  was originally
+Timer = tic;
 if p.Results.debuglvl >= STEP_THROUGH_ACTIONS
   disp('Starting to apply undo actions');
   for ii=UndoActions.length:-1:1
-    fprintf(1,'Press space to unapply: %s\n',UndoActions.( ACTION_DESC_NAME(ii) ));
+    fprintf(1,'Press space to unapply: %s\n',UndoActions.Description{ii});
     pause;
-    UndoActions.( ACTION_FUNC_NAME(ii) )();
+    ApplyActions(UndoActions,ii);
   end
   disp('Finished applying undo actions');
 else
-  for ii=UndoActions.length:-1:1
-    UndoActions.( ACTION_FUNC_NAME(ii) )();
-  end
+  ApplyActions(UndoActions,UndoActions.length:-1:1);
 end
 
 % Flush all drawing operations
 drawnow;
+Timing.UndoActions = toc(Timer);
 
-% Sort by text size first
-[Y,I] = sortrows( cell2mat( PsfragCmds(:,4) ) ); %#ok<*ASGLU> Required for backward compatibility
-PsfragCmds = PsfragCmds(I,:);
-% Now sort by colour
-[Y,I] = sortrows( cell2mat( PsfragCmds(:,5) ), [3 2 1] );
-PsfragCmds = PsfragCmds(I,:);
-% Now sort by font angle
-[Y,I] = sortrows( cell2mat( PsfragCmds(:,6) ) );
-PsfragCmds = PsfragCmds(I,:);
-% Now sort by font weight
-[Y,I] = sortrows( cell2mat( PsfragCmds(:,7) ) );   
-PsfragCmds = PsfragCmds(I,:);
-% Now sort by whether it is 'fixed width'
-[Y,I] = sortrows( cell2mat( PsfragCmds(:,8) ) );
-PsfragCmds = PsfragCmds(I,:);
-% Now sort by label type
-[Y,I] = sortrows( PsfragCmds(:,9) );
+% Group the commands by font style (size, colour, angle, weight and fixed
+% width), and sort them by label type then style, all with one key. The
+% order is the same as sorting by size, colour (blue, green then red),
+% angle, weight, fixed width then type, each sort keeping the order of the
+% last.
+PsfragCmds = PsfragCmds(1:NumPsfragCmds,:);
+Styles = [ cell2mat(PsfragCmds(:,4)), cell2mat(PsfragCmds(:,5)), cell2mat(PsfragCmds(:,6:8)) ];
+[Y,I,TypeId] = unique(PsfragCmds(:,9)); %#ok<*ASGLU> Required for backward compatibility
+[Y,I,StyleId] = unique(Styles,'rows');
+[Y,I] = sortrows( [TypeId(:), Styles(:,[7 6 5 4 3 2 1])] );
 PsfragCmds = PsfragCmds(I,:);
+StyleId = StyleId(I);
 clear Y
 
 % Finally write the latex-file
+Timer = tic;
 try
   fid = fopen([FileName,'.tex'],'w');
   fwrite(fid,TEXHDR);
   
+  % Each font style is defined once, the first time that it is used
   FontStylePrefix = 'matlabtext';
-  FontStyleId = double('A')-1;
-  NewFontStyle = 1;
-  CurrentColour = [0 0 0];
-  CurrentFontSize = 0;
-  CurrentWeight = 0;
-  CurrentAngle = 0;
-  CurrentlyFixedWidth = 0;
+  LastFontStyleId = double('A')-1;
+  FontStyleIds = zeros(1,max(StyleId));
   CurrentType = PsfragCmds{1,9};
   
   fprintf(fid,'\n%%');
@@ -361,31 +544,7 @@ try
   
   fprintf(fid,'\n%%\n%%%% <%s>',CurrentType);
   for ii=1:size(PsfragCmds,1)
-    % Test to see if the font size has changed
-    if ~(CurrentFontSize == PsfragCmds{ii,4})
-      CurrentFontSize = PsfragCmds{ii,4};
-      NewFontStyle = 1;
-    end
-    % Test to see if the colour has changed
-    if ~all(CurrentColour == PsfragCmds{ii,5})
-      CurrentColour = PsfragCmds{ii,5};
-      NewFontStyle = 1;
-    end
-    % Test to see if the font angle has changed
-    if ~(CurrentAngle == PsfragCmds{ii,6})
-      CurrentAngle = PsfragCmds{ii,6};
-      NewFontStyle = 1;
-    end
-    % Test to see if the font weight has changed
-    if ~(CurrentWeight == PsfragCmds{ii,7})
-      CurrentWeight = PsfragCmds{ii,7};
-      NewFontStyle = 1;
-    end
-    % Test to see if 'fixedwidth' has changed
-    if ~(CurrentlyFixedWidth == PsfragCmds{ii,8})
-      CurrentlyFixedWidth = PsfragCmds{ii,8};
-      NewFontStyle = 1;
-    end
+    NewFontStyle = FontStyleIds(StyleId(ii)) == 0;
     % Test to see if 'type' has changed
     if ~strcmpi(CurrentType,PsfragCmds{ii,9})
       fprintf(fid,'\n%%\n%%%% </%s>',CurrentType);
@@ -396,19 +555,22 @@ try
       end
     end
     if NewFontStyle
-      FontStyleId = FontStyleId + 1;
-      if CurrentAngle; Angle = '\itshape';
+      LastFontStyleId = LastFontStyleId + 1;
+      FontStyleIds(StyleId(ii)) = LastFontStyleId;
+      CurrentColour = PsfragCmds{ii,5};
+      CurrentFontSize = PsfragCmds{ii,4};
+      if PsfragCmds{ii,6}; Angle = '\itshape';
       else Angle = ''; end;
-      if CurrentWeight; Weight = '\bfseries\boldmath';
+      if PsfragCmds{ii,7}; Weight = '\bfseries\boldmath';
       else Weight = ''; end;
-      if CurrentlyFixedWidth; Fixed = '\ttfamily';
+      if PsfragCmds{ii,8}; Fixed = '\ttfamily';
       else Fixed = ''; end;
       fprintf(fid,['\n%%\n\\providecommand\\%s%s{\\color[rgb]{%.3f,%.3f,'...
         '%.3f}\\fontsize{%.2f}{%.2f}%s%s%s\\selectfont\\strut}%%'],FontStylePrefix,...
-        char(FontStyleId),CurrentColour(1),CurrentColour(2),...
+        char(LastFontStyleId),CurrentColour(1),CurrentColour(2),...
         CurrentColour(3),CurrentFontSize,CurrentFontSize,Angle,Weight,Fixed);
-      NewFontStyle = 0;
     end
+    FontStyleId = FontStyleIds(StyleId(ii));
 
     if(iscell(PsfragCmds{ii,2})) % Legend has a seperate text cell for each entry
         for ci=1:length(PsfragCmds{ii,2})
@@ -419,7 +581,7 @@ try
               fprintf(fid,'[%s][%s]',PsfragCmds{ii,3},PsfragCmds{ii,3});
             end
             fprintf(fid,'{\\%s%s %s}%%',FontStylePrefix,...
-              char(FontStyleId),EscapeSpecial(RemoveSpaces(PsfragCmds{ii,1}{ci})));
+              char(FontStyleId),LatexString(PsfragCmds{ii,1}{ci}));
         end
     else % All other text
         fprintf(fid,'\n\\psfrag{%s}',PsfragCmds{ii,2});
@@ -429,7 +591,7 @@ try
           fprintf(fid,'[%s][%s]',PsfragCmds{ii,3},PsfragCmds{ii,3});
         end
         fprintf(fid,'{\\%s%s %s}%%',FontStylePrefix,...
-          char(FontStyleId),EscapeSpecial(RemoveSpaces(PsfragCmds{ii,1})));
+          char(FontStyleId),LatexString(PsfragCmds{ii,1}));
     end
 
   end
@@ -445,6 +607,40 @@ catch                % -- needed for r2007a support
   err.stack.line
   rethrow( err );
 end
+Timing.Tex = toc(Timer);
+
+% Only replace the files if they have changed
+if Incremental
+  if ~ReplaceIfChanged(FileName,OutName,EpsKey) && ...
+      p.Results.debuglvl >= SHOW_OPTIONS
+    fprintf(1,'INCREMENTAL: %s is unchanged\n',OutName);
+  end
+end
+
+Timing.Total = toc(TotalTimer);
+if p.Results.debuglvl >= SHOW_TIMING
+  if Incremental
+    FileName = OutName;
+  end
+  fprintf(1,['TIMING: %s: %.3f s total: %.3f s legends, %.3f s ticks, ',...
+    '%.3f s text, %.3f s actions\n'],FileName,Timing.Total,Timing.Legends,...
+    Timing.Ticks,Timing.Text,Timing.Actions);
+  fprintf(1,'TIMING: %s: print%s s, %.3f s file wait, %.3f s combine\n',...
+    FileName,sprintf(' %.3f',Timing.Print),Timing.FileWait,Timing.Combine);
+  fprintf(1,['TIMING: %s: %.3f s pad, %.3f s compress, %.3f s undo actions, ',...
+    '%.3f s tex\n'],FileName,Timing.Pad,Timing.Compress,Timing.UndoActions,...
+    Timing.Tex);
+end
+
+if nargout > 0
+  varargout{1} = Job;
+end
+if nargout > 1
+  varargout{2} = Timing;
+end
+if nargout > 2
+  varargout{3} = true;
+end
 % All done! Below are the sub-functions
 
 % Find all of the 'text' and 'axes' objects in the
@@ -472,19 +668,25 @@ end
     textpos = GetTextPos(texthandles);
     
     % Freeze all legends (after axes and legend listeners have been disables)
+    StageTimer = tic;
     for jj=1:length(legendhandles)
       ProcessLegends(legendhandles(jj));
     end
+    Timing.Legends = toc(StageTimer);
     
     % Freeze all axes, and process ticks.
+    StageTimer = tic;
     for jj=1:length(axeshandles)
       ProcessTicks(axeshandles(jj));
     end
+    Timing.Ticks = toc(StageTimer);
     
     % Process all text.
+    StageTimer = tic;
     for jj=1:length(texthandles)
       ProcessText(texthandles(jj),textpos{jj});
     end
+    Timing.Text = toc(StageTimer);
   end
 
 % Get all fo the text object's positions.
@@ -492,7 +694,7 @@ end
     TextPos = cell(1,length(texthandles));
     for jj=1:length(texthandles)
       TextPos{jj} = get(texthandles(jj),'position');
-      AddUndoAction('Reset text posision', @() set(texthandles(jj),'position', TextPos{jj} ));
+      AddUndoAction('Reset text posision', {texthandles(jj),{'position'},TextPos(jj)});
     end
   end
 
@@ -545,19 +747,17 @@ end
     if isempty(sscanf(String,'%s')) && isempty(UserString); return; end;
     % Retrieve the common options
     [FontSize,FontAngle,FontWeight,FixedWidth] = CommonOptions(handle);
-    % Assign a replacement action for the string
+    % Assign a replacement action for the string, with the interpreter
+    % to none, and make sure the final position is the same as the
+    % original one. Every text gets the same properties set, so they are
+    % all applied in one go.
     CurrentReplacement = ReplacementString();
-    SetUnsetProperties('Replacing text string',handle,'String',CurrentReplacement);
+    SetUnsetProperties('Replacing text string',handle,'String',CurrentReplacement,...
+      'interpreter','none','position',Pos);
     % Check for a 'UserData' property, which replaces the string with latex
     if ~isempty(UserString)
       String = cell2mat(UserString{:});
     end
-    % Replacement action for the interpreter
-    if ~strcmpi(get(handle,'interpreter'),'none')
-      SetUnsetProperties('Text Interpreter to none',handle,'interpreter','none');
-    end
-    % Make sure the final position is the same as the original one
-    AddAction('Set text pos to where it originally was', @() set(handle,'position',Pos) );
     
     % Get the text colour
     Colour = get(handle,'color');
@@ -651,26 +851,28 @@ end
       set(handle,[jj,'tickmode'],'manual',[jj,'ticklabelmode'],'manual');
       if ~isempty(ticklabels)
         tickcolour = get(handle,[jj,'color']);
+        if ~iscell(ticklabels)
+          ticklabels = cellstr(ticklabels);
+        end
         
         % Test to see if it is on a logarithmic scale
         if strcmpi(get(handle,[jj,'scale']),'log') && AutoTickLabel.(jj)
-          ticklabelcell = mat2cell(ticklabels,ones(1,size(ticklabels,1)),size(ticklabels,2));
           if strcmpi( p.Results.unaryminus, 'short' )
-            ticklabels = cellfun(@(x) ['\mathmodel',...
-              regexprep( RemoveSpaces(x), '-', ['\\',NEGTICK_SHORT_SCRIPT_COMMAND,' '] ),...
-              '\mathmoder'],ticklabelcell,'uniformoutput',0);
+            ticklabels = FormatTickLabels(ticklabels,NEGTICK_SHORT_SCRIPT_COMMAND);
           else
-            ticklabels = cellfun(@(x) ['\mathmodel',RemoveSpaces(x),...
-              '\mathmoder'],ticklabelcell,'uniformoutput',0);
+            ticklabels = FormatTickLabels(ticklabels,'');
           end
           
           % Test to see if there is a common factor
         elseif strcmpi(get(handle,[jj,'scale']),'linear') && AutoTickLabel.(jj)
-          for kk=1:size(ticklabels,1)
-            % Find the first non-NaN ratio between tick labels and tick
-            % values
-            scale = ticks(kk)/str2double(ticklabels(kk,:));
-            if ~isnan(scale); break; end;
+          % Find the first non-NaN ratio between tick values and tick
+          % labels
+          tickcount = min(length(ticks),length(ticklabels));
+          scale = reshape(ticks(1:tickcount),[],1)./...
+            reshape(str2double(ticklabels(1:tickcount)),[],1);
+          scale = scale( find(~isnan(scale),1) );
+          if isempty(scale)
+            scale = NaN;
           end
           
           % If the scale is not 1, then we need to place a marker near the
@@ -682,7 +884,7 @@ end
               ['Non integer axes scaling.  This is most likely a bug in matlabfrag.\n',...
               'Please let me know the ytick and yticklabel values for this plot.']);
             if strcmpi( p.Results.unaryminus, 'short' )
-              LatexScale = ['\mathmodel\times10^{', regexprep( num2str(round(scale)), '-', ['\\',NEGTICK_SHORT_SCRIPT_COMMAND,' '] ), '}\mathmoder'];
+              LatexScale = ['\mathmodel\times10^{', strrep( num2str(round(scale)), '-', ['\',NEGTICK_SHORT_SCRIPT_COMMAND,' '] ), '}\mathmoder'];
             else
               LatexScale = ['\mathmodel\times10^{',num2str(round(scale)),'}\mathmoder'];
             end
@@ -822,45 +1024,15 @@ end
         
         % Test whether all of the ticks are numbers, if so, substitute in
         % proper minus signs.
-        if ~iscell(ticklabels)
-          ticklabels = mat2cell(ticklabels,ones(1,size(ticklabels,1)),size(ticklabels,2));
-        end
-        TicksAreNumbers = 1;
-        for kk=1:size(ticklabels,1)
-          if isempty(ticklabels{kk,:})
-            continue;
-          end
-          if isnan(str2double(ticklabels{kk,:}))
-            TicksAreNumbers = 0;
-            break;
-          end
-        end
-        if TicksAreNumbers
+        if all( ~isnan( str2double( ticklabels( ~cellfun('isempty',ticklabels) ) ) ) )
           if (Plot2D && strcmpi(jj,'x')) || (~Plot2D && any(strcmpi(jj,{'x','y'})) )
-            for kk=1:size(ticklabels)
-              if isempty(ticklabels{kk,:})
-                continue;
-              end
-              ticklabels{kk,:} = ['\mathmodel',...
-              RemoveSpaces( regexprep(ticklabels{kk,:},'-',['\\',NEGTICK_NO_WIDTH_COMMAND,' ']) ),...
-              '\mathmoder'];
-            end
+            ticklabels = FormatTickLabels(ticklabels,NEGTICK_NO_WIDTH_COMMAND);
+          elseif strcmpi( p.Results.unaryminus, 'short' )
+            ticklabels = FormatTickLabels(ticklabels,NEGTICK_SHORT_COMMAND);
           else
-            for kk=1:size(ticklabels)
-              if isempty(ticklabels{kk,:})
-                continue;
-              end
-              if strcmpi( p.Results.unaryminus, 'short' )
-                ticklabels{kk,:} = ['\mathmodel',...
-                  RemoveSpaces( regexprep(ticklabels{kk,:},'-',['\\',NEGTICK_SHORT_COMMAND,' ']) ),...
-                  '\mathmoder'];
-              else
-                ticklabels{kk,:} = ['\mathmodel', RemoveSpaces( ticklabels{kk,:} ),'\mathmoder'];
-              end
-            end
+            ticklabels = FormatTickLabels(ticklabels,'');
           end
         end
-        clear TicksAreNumbers
         
         tickreplacements = cell(1,size(ticklabels,1));
         % Process the X and Y tick alignment
@@ -901,6 +1073,25 @@ end
     end
   end    % of ProcessTicks
 
+% Format the tick labels of an axis for LaTeX, all in one go: trim them,
+%  substitute NegCommand for the minus signs (unless it is empty), and put
+%  them in math mode. Empty labels are left empty.
+  function ticklabels = FormatTickLabels(ticklabels,NegCommand)
+    ticklabels = strtrim(ticklabels);
+    if ~isempty(NegCommand)
+      ticklabels = strrep(ticklabels,'-',['\',NegCommand,' ']);
+    end
+    % A trailing backslash would escape the closing $
+    trailing = endsWith(ticklabels,'\');
+    if any(trailing)
+      ticklabels(trailing) = strcat(ticklabels(trailing),{' '});
+    end
+    labelled = ~cellfun('isempty',ticklabels);
+    if any(labelled)
+      ticklabels(labelled) = strcat({'\mathmodel'},ticklabels(labelled),{'\mathmoder'});
+    end
+  end
+
 % Get the next replacement string
   function CurrentReplacement = ReplacementString()
     CurrentReplacement = sprintf(REPLACEMENT_FORMAT,StringCounter);
@@ -971,7 +1162,11 @@ end
 %  standard calling convention to be established.
   function AddPsfragCommand(LatexString,ReplacementString,Alignment,...
       FontSize,Colour,FontAngle,FontWeight,FixedWidth,Type)
-    PsfragCmds(size(PsfragCmds,1)+1,:) = {LatexString,ReplacementString,...
+    if NumPsfragCmds == size(PsfragCmds,1)
+      PsfragCmds{2*NumPsfragCmds,1} = [];
+    end
+    NumPsfragCmds = NumPsfragCmds + 1;
+    PsfragCmds(NumPsfragCmds,:) = {LatexString,ReplacementString,...
       Alignment,FontSize,Colour,FontAngle,FontWeight,FixedWidth,Type};
   end
 
@@ -981,24 +1176,81 @@ end
     Props = varargin(1:2:end);
     PropVals = varargin(2:2:end);
     TempPropVals = get(handle,Props);
-    AddAction(description, @() set(handle,Props,PropVals) );
-    AddUndoAction(description, @() set(handle,Props,TempPropVals) );
+    AddAction(description, {handle,Props,PropVals} );
+    AddUndoAction(description, {handle,Props,TempPropVals} );
   end
 
-% Add an 'action' function to the list of actions to perform before the
-%  image is saved.
+% Add an 'action' (a function, or a property change) to the list of
+%  actions to perform before the image is saved.
   function AddAction(description,action)
+    if Actions.length == length(Actions.Action)
+      Actions.Action{2*Actions.length} = [];
+      Actions.Description{2*Actions.length} = [];
+    end
     Actions.length = Actions.length + 1;
-    Actions.( ACTION_FUNC_NAME( Actions.length ) ) = action;
-    Actions.( ACTION_DESC_NAME( Actions.length ) ) = description;
+    Actions.Action{Actions.length} = action;
+    Actions.Description{Actions.length} = description;
   end
 
-% Adds an 'undo-action' function to the list... these get processed after
-%  the image has been saved, to restore the screen state.
+% Adds an 'undo-action' to the list... these get processed after the image
+%  has been saved, to restore the screen state.
   function AddUndoAction(description,action)
+    if UndoActions.length == length(UndoActions.Action)
+      UndoActions.Action{2*UndoActions.length} = [];
+      UndoActions.Description{2*UndoActions.length} = [];
+    end
     UndoActions.length = UndoActions.length + 1;
-    UndoActions.( ACTION_FUNC_NAME( UndoActions.length ) ) = action;
-    UndoActions.( ACTION_DESC_NAME( UndoActions.length ) ) = description;
+    UndoActions.Action{UndoActions.length} = action;
+    UndoActions.Description{UndoActions.length} = description;
+  end
+
+% Apply the actions of a queue, in the given order. A run of property
+%  changes that set the same properties, each on a single handle of the
+%  same class, is made with one call to set.
+  function ApplyActions(Queue,order)
+    kk = 1;
+    while kk <= length(order)
+      action = Queue.Action{order(kk)};
+      if ~iscell(action)
+        action();
+        kk = kk + 1;
+        continue;
+      end
+      last = kk;
+      if numel(action{1}) == 1
+        while last < length(order)
+          following = Queue.Action{order(last+1)};
+          if ~iscell(following) || numel(following{1}) ~= 1 || ...
+              ~strcmp(class(following{1}),class(action{1})) || ~isequal(following{2},action{2})
+            break;
+          end
+          last = last + 1;
+        end
+      end
+      if last == kk
+        set(action{1},action{2},action{3});
+      else
+        batch = vertcat( Queue.Action{order(kk:last)} );
+        set( vertcat(batch{:,1}), action{2}, vertcat(batch{:,3}) );
+      end
+      kk = last + 1;
+    end
+  end
+
+% Converts the text of a label to LaTeX, looking it up in the session's
+%  cache of conversions first.
+  function str = LatexString(str)
+    str = RemoveSpaces(str);
+    if ~ischar(str) || size(str,1) ~= 1
+      str = EscapeSpecial(str);
+      return;
+    end
+    [found,latex] = LatexCache('get',str);
+    if ~found
+      latex = EscapeSpecial(str);
+      LatexCache('put',str,latex);
+    end
+    str = latex;
   end
 
 % Surrounds the Matlab supported Tex characters in math mode
@@ -1115,18 +1367,30 @@ end
 % on some platforms the file isn't available immediately after performing a
 % print.
   function FileWait(filename)
-    counter = 0;
-    while ~exist(filename,'file')
-      pause(0.05);
-      assert( counter < 100, 'matlabfrag:filetimeout',...
-        'File Timeout. This occured after printing %s and trying to then read it.',filename);
-      counter = counter + 1;
+    % The filewait MEX file waits on the folder rather than polling.
+    % Otherwise poll, backing off from 1 ms to 50 ms, for up to 5 s.
+    WaitTimer = tic;
+    if exist('filewait','file') == 3
+      found = filewait(filename,5);
+    else
+      found = exist(filename,'file');
+      delay = 0.001;
+      waited = 0;
+      while ~found && waited < 5
+        pause(delay);
+        waited = waited + delay;
+        delay = min(2*delay,0.05);
+        found = exist(filename,'file');
+      end
     end
+    Timing.FileWait = Timing.FileWait + toc(WaitTimer);
+    assert( found ~= 0, 'matlabfrag:filetimeout',...
+      'File Timeout. This occured after printing %s and trying to then read it.',filename);
   end
 % Print two versions of the file, one renderered with the renderer of
 % choice, and another rendererd with painters. Then perform some epscombine
 % magic to recombine them.
-  function EpsCombine(handle,renderer,filename,dpiswitch,keep_tempfile)
+  function EpsCombine(handle,renderer,filename,dpiswitch,keep_tempfile,textonly)
     TEXTOBJ_REGEXP = ['-?\d+\s+-?\d+\s+mt(\s+-?\d+\s+rotate)?',...
       '\s+\(.+?\)\s+s',...
       '(\s+-?\d+\s+rotate)?'];
@@ -1136,6 +1400,17 @@ end
     else
       tmp_file = tempname;
     end
+    % If the epscombine MEX file has been compiled, the renderer's version
+    % is printed to a temporary file too, and the two are combined into
+    % the output file without reading them into Matlab.
+    UseMex = exist('epscombine','file') == 3;
+    if ~UseMex
+      main_file = filename;
+    elseif keep_tempfile
+      main_file = [filename,'-',renderer];
+    else
+      main_file = tempname;
+    end
     
     % Show all of the hidden handles
     hidden = get(0,'showhiddenhandles');
@@ -1164,9 +1439,11 @@ end
     end
     % Now print it.
     drawnow;
+    PrintTimer = tic;
     print(handle,'-depsc2','-loose',dpiswitch,...
-      ['-',renderer],filename);
-    FileWait([filename,'.eps']);
+      ['-',renderer],main_file);
+    Timing.Print(end+1) = toc(PrintTimer);
+    FileWait([main_file,'.eps']);
     % Restore the text
     set(ht,'visible','on');
     for jj=1:length(ha)
@@ -1174,11 +1451,59 @@ end
       set(ha(jj),'yticklabel',tickvals.(hnam(jj)).ytl);
       set(ha(jj),'zticklabel',tickvals.(hnam(jj)).ztl);
     end
-    % Now print a painters version.
+    % Only the text of the painters version is used, so if asked, hide
+    % everything else first. The limits and ticks are frozen, so that
+    % hiding the data doesn't move them.
+    if textonly
+      set(0,'showhiddenhandles','on');
+      hd = findobj(handle,'-regexp','type','^(line|surface|patch|image|rectangle)$');
+      set(0,'showhiddenhandles',hidden);
+      hd = setdiff( findobj(hd,'flat','visible','on'), hv );
+      modeprops = {'xlimmode','ylimmode','zlimmode','climmode',...
+        'xtickmode','ytickmode','ztickmode'};
+      modes = get(ha,modeprops);
+      set(ha,modeprops,repmat({'manual'},size(modes)));
+      set(hd,'visible','off');
+    end
+    % Now print a painters version. If that fails, the hidden data and
+    % frozen modes are restored before the error is passed on.
     drawnow;
-    print(handle,'-depsc2','-loose',dpiswitch,...
-      '-painters',tmp_file);
-    FileWait([tmp_file,'.eps']);
+    PrintTimer = tic;
+    try
+      print(handle,'-depsc2','-loose',dpiswitch,...
+        '-painters',tmp_file);
+      Timing.Print(end+1) = toc(PrintTimer);
+      FileWait([tmp_file,'.eps']);
+    catch                  % -- required for r2007a support
+      err = lasterror;     %#ok
+      if textonly
+        set(hd,'visible','on');
+        set(ha,modeprops,modes);
+      end
+      rethrow( err );
+    end
+    if textonly
+      set(hd,'visible','on');
+      set(ha,modeprops,modes);
+    end
+    if UseMex
+      % The temporary files are deleted even if the merge fails
+      try
+        epscombine([main_file,'.eps'],[tmp_file,'.eps'],[filename,'.eps']);
+      catch                  % -- required for r2007a support
+        err = lasterror;     %#ok
+        if ~keep_tempfile
+          delete([main_file,'.eps']);
+          delete([tmp_file,'.eps']);
+        end
+        rethrow( err );
+      end
+      if ~keep_tempfile
+        delete([main_file,'.eps']);
+        delete([tmp_file,'.eps']);
+      end
+      return;
+    end
     % Open it up and extract the text
     try
       fh = fopen([tmp_file,'.eps'],'r');
@@ -1305,6 +1630,340 @@ end
 
 end % of matlabfrag(FileName,p.Results.handle)
 
+% Parser for the options of matlabfrag. It is only built once per session,
+%  so the handle defaults to empty, standing for the current figure.
+%  Being shared, its Results are overwritten by the next parse.
+function p = OptionParser()
+persistent Parser
+if ~isempty(Parser)
+  p = Parser;
+  return;
+end
+p = inputParser;
+p.FunctionName = 'matlabfrag';
+
+p.addRequired('FileName', @(x) ischar(x) );
+p.addParameter('handle', [], @(x) isempty(x) || ...
+  ( ishandle(x) && strcmpi(get(x,'Type'),'figure') ) );
+p.addParameter('epspad', [0,0,0,0], @(x) isnumeric(x) && (all(size(x) == [1 4])) );
+p.addParameter('renderer', 'painters', ...
+  @(x) any( strcmpi(x,{'painters','opengl','zbuffer'}) ) );
+p.addParameter('dpi', 300, @(x) isnumeric(x) );
+p.addParameter('compress',1, @(x) (isnumeric(x) || islogical(x) || ...
+  any( strcmpi(x,{'lzw','flate'}) ) ) );
+p.addParameter('debuglvl',0, @(x) isnumeric(x) && x>=0);
+p.addParameter('unaryminus','normal', @(x) any( strcmpi(x,{'short','normal'}) ) );
+p.addParameter('textpass','full', @(x) any( strcmpi(x,{'full','textonly'}) ) );
+p.addParameter('async',false, @(x) (isnumeric(x) || islogical(x)) && isscalar(x) );
+p.addParameter('incremental',false, @(x) (isnumeric(x) || islogical(x)) && isscalar(x) );
+p.addParameter('epsbudget',inf, @(x) isnumeric(x) && isscalar(x) && x > 0 );
+Parser = p;
+end
+
+% The Matlab version, checking that it is new enough, and the header of the
+%  .tex files with the version of matlabfrag. These are only worked out
+%  once per session.
+function [v,TEXHDR] = SessionInfo()
+persistent MatlabVersion Header
+if isempty(MatlabVersion)
+  % Matlab version check
+  v = version;
+  v = regexp(v,'(\d+)\.(\d+)\.\d+\.\d+','tokens');
+  v = str2double(v{1});
+  if v(1) < 7
+    error('matlabfrag:oldMatlab','Matlabfrag requires Matlab r2007a or newer to run');
+  elseif v(1) == 7
+    if v(2) < 4
+      error('matlabfrag:oldMatlab','Matlabfrag requires Matlab r2007a or newer to run');
+    end
+  end
+
+  % Version information is taken from the above help information
+  HelpText = help('matlabfrag');
+  LatestVersion = regexp(HelpText,'(v[\d\.]+\w*?) ([\d]+\-[\w]+\-[\d]+)','tokens');
+  LatestVersion = LatestVersion{1};
+  Version = LatestVersion{1};
+  VersionDate = LatestVersion{2};
+  Header = sprintf('%% Generated using matlabfrag\n%% Version: %s\n%% Version Date: %s\n%% Author: Zebb Prime',...
+    Version,VersionDate);
+  MatlabVersion = v;
+end
+v = MatlabVersion;
+TEXHDR = Header;
+end
+
+% Compress an eps file in place. Under a size budget, it is compressed
+%  beside itself with its bitmaps downsampled by 1, 2, 4, ... until it
+%  fits (or there are no bitmaps to shrink), so that the figure is only
+%  printed once; the factor used is returned as Downsample.
+function [bytes,stats,Downsample] = CompressEpsFile(FileName,CompressMethod,epspad,Budget)
+Downsample = 1;
+if isinf(Budget)
+  [bytes,stats] = epscompress([FileName,'.eps'],[FileName,'.eps'],...
+    'method',CompressMethod,'images',strcmp(CompressMethod,'flate'),...
+    'epspad',epspad);
+  return;
+end
+while true
+  [bytes,stats] = epscompress([FileName,'.eps'],[FileName,'-budget.eps'],...
+    'method',CompressMethod,'images',true,'downsample',Downsample,...
+    'epspad',epspad);
+  if bytes <= Budget || stats.Images == 0 || Downsample >= 64
+    break;
+  end
+  Downsample = 2*Downsample;
+end
+movefile([FileName,'-budget.eps'],[FileName,'.eps'],'f');
+end
+
+% Whether compression jobs may have been queued in the background this
+%  session, so that there can be files to wait for. QueuedJobs(true)
+%  records that some have been (or are about to be).
+function tf = QueuedJobs(queued)
+persistent Queued
+if isempty(Queued)
+  Queued = false;
+end
+if nargin > 0
+  Queued = Queued || queued;
+end
+tf = Queued;
+end
+
+% Whether the compiled epscompress is one that takes options and lists of
+%  files. An older one only takes the two file names, so errors on the
+%  '-status' query. Once found, this is kept for the session.
+function tf = NewEpscompress()
+persistent IsNew
+if isempty(IsNew)
+  if exist('epscompress','file') ~= 3
+    tf = false;
+    return;
+  end
+  try
+    epscompress('-status');
+    IsNew = true;
+  catch
+    IsNew = false;
+  end
+end
+tf = IsNew;
+end
+
+% Compress an eps file with just the input and output file names, which
+%  is all that an older compiled version of epscompress takes. It can't
+%  compress in place, so the file is moved aside first, and put back if
+%  the compression fails.
+function PlainCompressEpsFile(filename)
+uncompressed = [filename(1:end-4),'-uncompressed.eps'];
+movefile(filename,uncompressed,'f');
+try
+  epscompress(uncompressed,filename);
+catch                % -- required for r2007a support
+  err = lasterror;   %#ok
+  movefile(uncompressed,filename,'f');
+  rethrow(err);
+end
+delete(uncompressed);
+end
+
+% Pad the bounding box of an eps file in Matlab, for when epscompress
+%  isn't doing it.
+function PadEpsFile(filename,epspad)
+fh = fopen(filename,'r');
+epsfile = fread(fh,inf,'uint8=>char').';
+fclose(fh);
+bb = regexpi(epsfile,'\%\%BoundingBox:\s+(-*\d+)\s+(-*\d+)\s+(-*\d+)\s+(-*\d+)','tokens');
+bb = str2double(bb{1});
+epsfile = regexprep(epsfile,sprintf('%i(\\s+)%i(\\s+)%i(\\s+)%i',bb),...
+  sprintf('%i$1%i$2%i$3%i',bb+round(epspad.*[-1,-1,1,1])));
+fh = fopen(filename,'w');
+fwrite(fh,epsfile);
+fclose(fh);
+end
+
+% Export a batch of figures,
+%  BatchExport({FileName1,FileName2,...},'handle',[h1,h2,...],OPTIONS)
+% Each figure is processed and printed in turn. If they are to be
+% compressed and the compiled epscompress takes lists of files, the
+% compression (and padding) is left until they have all been printed,
+% then done in one call that spreads the files over the processors. With
+% async, the files are queued instead, returning their job numbers. Files
+% the call fails on are padded and compressed one at a time.
+% Incrementally, each figure is compressed as it is exported, as that is
+% where it is compared. The stage times of each figure are returned in
+% Timing, with a deferred compression's time given as the Compress time of
+% every figure.
+function [Jobs,Timing] = BatchExport(FileNames,varargin)
+Jobs = [];
+Timing = [];
+assert( iscellstr(FileNames), 'matlabfrag:batch',...
+  'The file names must be a cell array of strings.' );
+% Take the figure handles out of the shared options
+options = varargin;
+handles = [];
+for ii=2*floor(numel(options)/2)-1:-2:1
+  if ischar(options{ii}) && strcmpi(options{ii},'handle')
+    handles = options{ii+1};
+    options(ii:ii+1) = [];
+  end
+end
+if isempty(handles) && numel(FileNames) == 1
+  handles = gcf;
+end
+assert( numel(handles) == numel(FileNames), 'matlabfrag:batch',...
+  'A figure handle is needed for each file name.' );
+% The parser is shared with each figure's export, so its results are
+% copied out first
+p = OptionParser();
+p.parse(FileNames{1},options{:},'handle',handles(1));
+Results = p.Results;
+
+% Defer the compression if it can be done in one go
+CompressEps = Results.compress;
+CompressMethod = 'lzw';
+if ischar(CompressEps)
+  CompressMethod = lower(CompressEps);
+  CompressEps = 1;
+end
+Deferred = CompressEps && NewEpscompress() && ...
+  ~Results.incremental && isinf(Results.epsbudget);
+if Deferred
+  for ii=2*floor(numel(options)/2)-1:-2:1
+    if ischar(options{ii}) && any( strcmpi(options{ii},{'compress','epspad'}) )
+      options(ii:ii+1) = [];
+    end
+  end
+  options = [options,{'compress',0}];
+end
+
+HasText = true(1,numel(FileNames));
+for ii=1:numel(FileNames)
+  [Job,FigureTiming,HasText(ii)] = matlabfrag(FileNames{ii},options{:},...
+    'handle',handles(ii)); %#ok<ASGLU>
+  Timing = [Timing,FigureTiming]; %#ok<AGROW> One per figure
+end
+if ~Deferred
+  return;
+end
+Timer = tic;
+
+% Compress the files of the figures with text. Those without are printed
+% as they are, as for a single figure.
+EpsFiles = strcat(reshape(FileNames,1,[]),{'.eps'});
+EpsFiles = EpsFiles( HasText & cellfun(@(x) exist(x,'file') == 2, EpsFiles) );
+if isempty(EpsFiles)
+  return;
+end
+% If the batch call itself fails, they are all done one at a time below
+Bytes = -ones(1,numel(EpsFiles));
+Messages = repmat({''},1,numel(EpsFiles));
+try
+  if Results.async
+    QueuedJobs(true);
+    Jobs = epscompress(EpsFiles,EpsFiles,'method',CompressMethod,...
+      'images',strcmp(CompressMethod,'flate'),'epspad',Results.epspad,...
+      'async',true);
+    [Timing.Compress] = deal(toc(Timer));
+    return;
+  end
+  [Bytes,Messages] = epscompress(EpsFiles,EpsFiles,'method',CompressMethod,...
+    'images',strcmp(CompressMethod,'flate'),'epspad',Results.epspad);
+catch                % -- required for r2007a support
+  err = lasterror;   %#ok
+  Messages = repmat({err.message},1,numel(EpsFiles));
+end
+% The files that failed are padded while they are text, then retried
+% with the plain two-file call
+for ii=find(Bytes(:).' < 0)
+  if any( Results.epspad )
+    PadEpsFile(EpsFiles{ii},Results.epspad);
+  end
+  try
+    PlainCompressEpsFile(EpsFiles{ii});
+  catch
+    warning(['epscompress of ',EpsFiles{ii},' failed! ',Messages{ii}]);
+  end
+end
+[Timing.Compress] = deal(toc(Timer));
+end
+
+% Move the eps and tex files just written as NewName into place as
+%  OldName, unless they are the same as the ones already there, returning
+%  whether they were. The tex files are compared directly. The eps files
+%  are compared by EpsKey, kept in the OldName.hash manifest, or if there
+%  isn't one (the file wasn't compressed), by their contents apart from
+%  the creation date.
+function Changed = ReplaceIfChanged(NewName,OldName,EpsKey)
+Changed = ~( exist([OldName,'.eps'],'file') == 2 && ...
+  exist([OldName,'.tex'],'file') == 2 && ...
+  isequal(ReadFile([NewName,'.tex']),ReadFile([OldName,'.tex'])) );
+if ~Changed
+  if ~isempty(EpsKey)
+    Changed = ~( exist([OldName,'.hash'],'file') == 2 && ...
+      strcmp(strtrim(ReadFile([OldName,'.hash'])),EpsKey) );
+  else
+    Changed = ~isequal( ...
+      regexprep(ReadFile([NewName,'.eps']),'%%CreationDate:[^\r\n]*',''),...
+      regexprep(ReadFile([OldName,'.eps']),'%%CreationDate:[^\r\n]*','') );
+  end
+end
+if ~Changed
+  delete([NewName,'.eps']);
+  delete([NewName,'.tex']);
+  return;
+end
+movefile([NewName,'.eps'],[OldName,'.eps'],'f');
+movefile([NewName,'.tex'],[OldName,'.tex'],'f');
+if ~isempty(EpsKey)
+  fh = fopen([OldName,'.hash'],'w');
+  fprintf(fh,'%s\n',EpsKey);
+  fclose(fh);
+elseif exist([OldName,'.hash'],'file') == 2
+  delete([OldName,'.hash']);
+end
+end
+
+% The contents of a file, as a char row.
+function str = ReadFile(filename)
+fh = fopen(filename,'r');
+str = fread(fh,inf,'uint8=>char').';
+fclose(fh);
+end
+
+% Cache of the LaTeX conversions of label text, kept for the session.
+%  [found,latex] = LatexCache('get',str)
+%  LatexCache('put',str,latex)
+%  LatexCache('clear')
+% Once it holds LATEX_CACHE_SIZE strings, it is emptied and starts again.
+function [found,latex] = LatexCache(command,str,latex)
+LATEX_CACHE_SIZE = 10000;
+persistent Cache
+if isempty(Cache)
+  Cache = containers.Map('KeyType','char','ValueType','char');
+end
+found = false;
+switch command
+  case 'get'
+    % The empty string can't be a key, but is quick to convert anyway
+    if ~isempty(str) && isKey(Cache,str)
+      found = true;
+      latex = Cache(str);
+    else
+      latex = '';
+    end
+  case 'put'
+    if ~isempty(str)
+      if Cache.Count >= LATEX_CACHE_SIZE
+        Cache = containers.Map('KeyType','char','ValueType','char');
+      end
+      Cache(str) = latex;
+    end
+  case 'clear'
+    Cache = containers.Map('KeyType','char','ValueType','char');
+end
+end
+
 % Copyright (c) 2008--2013, Zebb Prime
 % All rights reserved.
 % 
@@ -43,12 +43,19 @@ fout = fclose(fout);
 %% Zip it up
 zip('matlabfrag',{'matlabfrag.m',...
   'epscompress.*',...
+  'epscompress_core.*',...
+  'epscompress_cli.c',...
+  'epscompress_bench.c',...
+  'epscombine.c',...
+  'filewait.c',...
+  'Makefile',...
   'userguide.pdf',...
   ['examples',filesep,'userguide.tex'],...
   ['examples',filesep,'testing.tex'],...
   ['examples',filesep,'ex*.m'],...
   ['examples',filesep,'comparison*.m'],...
-  ['examples',filesep,'test*.m'] });
+  ['examples',filesep,'test*.m'],...
+  ['examples',filesep,'bench_corpus.m'] });
 
 %% Clean up the output files
 close all